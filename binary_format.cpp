@@ -0,0 +1,773 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+#include "binary_format.hpp"
+#include "mapped_file.hpp"
+
+/*
+ * file layout, all integers in native byte order:
+ *   Header                               128 bytes
+ *   row offsets  uint64 x (row_count + 1)
+ *   cols         uint32 x nnz
+ *   vals         Rating x nnz
+ *   user ids     uint64 x user_count     external id of each internal id
+ *   item ids     uint64 x item_count
+ *   user sums    uint64 x user_count     rating sums and counts, see
+ *   user counts  uint64 x user_count     RatingStats
+ *   item sums    uint64 x item_count
+ *   item counts  uint64 x item_count
+ * every section starts at a multiple of ALIGNMENT and is zero padded,
+ * the payload (everything after the header) is covered by a checksum
+ *
+ * merged deltas follow as Header::delta_count segments, each
+ *   DeltaHeader                           64 bytes
+ *   user ids     uint64 x user_count      ids of the delta, in its own
+ *   item ids     uint64 x item_count      internal id order
+ *   row offsets  uint64 x (row_count + 1)
+ *   cols         uint32 x nnz
+ *   vals         Rating x nnz
+ * a segment is appended and then counted in the header, bytes after the
+ * counted segments are left by an interrupted append and ignored
+ */
+
+static_assert(sizeof(size_t) == sizeof(uint64_t),
+              "binary format stores size_t as 64-bit");
+
+static constexpr std::array<char, 8> MAGIC = {'R', 'S', 'M', 'A',
+                                              'T', 'R', 'I', 'X'};
+static constexpr uint32_t VERSION = 2;
+static constexpr uint32_t ENDIAN_MARK = 0x01020304;
+static constexpr size_t ALIGNMENT = 64;
+// Header::flags, deltas were merged in after the conversion
+static constexpr uint32_t FLAG_MERGED = 1;
+static constexpr std::array<char, 8> DELTA_MAGIC = {'R', 'S', 'D', 'E',
+                                                    'L', 'T', 'A', '1'};
+// the deltas are folded into the dataset once they hold more than
+// 1 / COMPACT_RATIO of its ratings, so reads merge a small overlay
+static constexpr uint64_t COMPACT_RATIO = 4;
+
+struct Header {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t endian;
+    uint32_t value_size;
+    uint32_t flags;
+    uint64_t row_count;
+    uint64_t nnz;
+    uint64_t user_count;
+    uint64_t item_count;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t payload_checksum;
+    uint64_t header_checksum;
+    uint64_t delta_count;
+    uint64_t delta_nnz;
+    std::array<uint8_t, 24> reserved1;
+};
+
+static_assert(sizeof(Header) == 128 && sizeof(Header) % ALIGNMENT == 0);
+
+struct DeltaHeader {
+    std::array<char, 8> magic;
+    uint64_t row_count;
+    uint64_t nnz;
+    uint64_t user_count;
+    uint64_t item_count;
+    uint64_t checksum;
+    std::array<uint8_t, 16> reserved1;
+};
+
+static_assert(sizeof(DeltaHeader) == ALIGNMENT);
+
+/**
+ * byte offsets of the sections
+ */
+struct Layout {
+    size_t offsets;
+    size_t cols;
+    size_t vals;
+    size_t users;
+    size_t items;
+    size_t user_sums;
+    size_t user_counts;
+    size_t item_sums;
+    size_t item_counts;
+    size_t end;
+};
+
+static size_t align_up(size_t size) {
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+/**
+ * compute the section offsets from the counts of a header
+ * @param header
+ * @param file_size counts that cannot fit in the file are rejected
+ *                  before any multiplication can overflow
+ * @return layout
+ */
+static Layout get_layout(const Header &header, size_t file_size) {
+    if (header.row_count >= file_size || header.nnz > file_size ||
+        header.user_count > file_size || header.item_count > file_size) {
+        throw std::runtime_error("Corrupt binary dataset: bad counts");
+    }
+    Layout layout{};
+    layout.offsets = sizeof(Header);
+    layout.cols = layout.offsets +
+                  align_up((header.row_count + 1) * sizeof(uint64_t));
+    layout.vals = layout.cols + align_up(header.nnz * sizeof(uint32_t));
+    layout.users = layout.vals + align_up(header.nnz * sizeof(Rating));
+    layout.items = layout.users +
+                   align_up(header.user_count * sizeof(uint64_t));
+    size_t user_section = align_up(header.user_count * sizeof(uint64_t));
+    size_t item_section = align_up(header.item_count * sizeof(uint64_t));
+    layout.user_sums = layout.items + item_section;
+    layout.user_counts = layout.user_sums + user_section;
+    layout.item_sums = layout.user_counts + user_section;
+    layout.item_counts = layout.item_sums + item_section;
+    layout.end = layout.item_counts + item_section;
+    return layout;
+}
+
+/**
+ * byte offsets of the sections of a delta segment, from its start
+ */
+struct DeltaLayout {
+    size_t users;
+    size_t items;
+    size_t offsets;
+    size_t cols;
+    size_t vals;
+    size_t end;
+};
+
+/**
+ * compute the section offsets of a delta segment
+ * @param header
+ * @param room bytes from the start of the segment to the end of the file
+ * @return layout
+ */
+static DeltaLayout get_delta_layout(const DeltaHeader &header, size_t room) {
+    if (header.magic != DELTA_MAGIC || header.row_count >= room ||
+        header.nnz > room || header.user_count > room ||
+        header.item_count > room) {
+        throw std::runtime_error("Corrupt binary dataset: bad delta");
+    }
+    DeltaLayout layout{};
+    layout.users = sizeof(DeltaHeader);
+    layout.items = layout.users +
+                   align_up(header.user_count * sizeof(uint64_t));
+    layout.offsets = layout.items +
+                     align_up(header.item_count * sizeof(uint64_t));
+    layout.cols = layout.offsets +
+                  align_up((header.row_count + 1) * sizeof(uint64_t));
+    layout.vals = layout.cols + align_up(header.nnz * sizeof(uint32_t));
+    layout.end = layout.vals + align_up(header.nnz * sizeof(Rating));
+    if (layout.end > room) {
+        throw std::runtime_error("Corrupt binary dataset: bad delta");
+    }
+    return layout;
+}
+
+/**
+ * 64-bit checksum over whole 32-byte groups,
+ * 4 independent lanes so the multiply chains overlap
+ */
+class Checksum {
+public:
+    static constexpr size_t GROUP = 32;
+
+    void update(const uint8_t *data, size_t size) {
+        for (size_t i = 0; i + GROUP <= size; i += GROUP) {
+            for (size_t lane = 0; lane < lanes.size(); ++lane) {
+                uint64_t word;
+                std::memcpy(&word, data + i + lane * sizeof(word),
+                            sizeof(word));
+                uint64_t h = (lanes[lane] ^ word) * PRIME;
+                lanes[lane] = h ^ (h >> 29);
+            }
+        }
+    }
+
+    uint64_t digest() const {
+        uint64_t h = 0;
+        for (uint64_t lane: lanes) {
+            h = (h ^ lane) * PRIME;
+            h ^= h >> 32;
+        }
+        return h;
+    }
+
+private:
+    static constexpr uint64_t PRIME = 0x9E3779B97F4A7C15ull;
+
+    std::array<uint64_t, 4> lanes = {1, 2, 3, 4};
+};
+
+static_assert(ALIGNMENT % Checksum::GROUP == 0);
+
+static uint64_t header_checksum(Header header) {
+    header.header_checksum = 0;
+    Checksum checksum;
+    checksum.update(reinterpret_cast<const uint8_t *>(&header),
+                    sizeof(header));
+    return checksum.digest();
+}
+
+/**
+ * start the checksum of a delta segment with its header
+ * @param header
+ * @return checksum to update with the sections of the segment
+ */
+static Checksum delta_checksum(DeltaHeader header) {
+    header.checksum = 0;
+    Checksum checksum;
+    checksum.update(reinterpret_cast<const uint8_t *>(&header),
+                    sizeof(header));
+    return checksum;
+}
+
+/**
+ * write a section followed by zero padding up to ALIGNMENT
+ * @param file
+ * @param checksum updated with the section and its padding
+ * @param data
+ * @param size size in bytes
+ */
+static void write_section(std::ofstream &file, Checksum &checksum,
+                          const void *data, size_t size) {
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    size_t whole = size / ALIGNMENT * ALIGNMENT;
+    checksum.update(bytes, whole);
+    file.write(reinterpret_cast<const char *>(bytes),
+               static_cast<std::streamsize>(whole));
+
+    if (whole < size) {
+        std::array<uint8_t, ALIGNMENT> tail{};
+        std::memcpy(tail.data(), bytes + whole, size - whole);
+        checksum.update(tail.data(), tail.size());
+        file.write(reinterpret_cast<const char *>(tail.data()),
+                   static_cast<std::streamsize>(tail.size()));
+    }
+}
+
+SourceStamp get_source_stamp(const std::string &filename) {
+    std::error_code error;
+    auto size = std::filesystem::file_size(filename, error);
+    if (error) {
+        return {};
+    }
+    auto mtime = std::filesystem::last_write_time(filename, error);
+    if (error) {
+        return {};
+    }
+    return {size, static_cast<int64_t>(mtime.time_since_epoch().count())};
+}
+
+void write_binary_dataset(const std::string &filename,
+                          const SparseMatrix<Rating> &mat,
+                          const IdDictionary &dict,
+                          const RatingStats &stats,
+                          const BinarySource &source) {
+    if (stats.user_sums.size() != dict.users.size() ||
+        stats.user_counts.size() != dict.users.size() ||
+        stats.item_sums.size() != dict.items.size() ||
+        stats.item_counts.size() != dict.items.size()) {
+        throw std::runtime_error("Rating stats do not match the dataset");
+    }
+    auto offsets = mat.offsets();
+    auto all = mat.get_all();
+    auto users = dict.users.external_ids();
+    auto items = dict.items.external_ids();
+
+    Header header{};
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.endian = ENDIAN_MARK;
+    header.value_size = sizeof(Rating);
+    header.row_count = offsets.empty() ? 0 : offsets.size() - 1;
+    header.nnz = all.size();
+    header.user_count = users.size();
+    header.item_count = items.size();
+    header.flags = source.merged ? FLAG_MERGED : 0;
+    header.source_size = source.stamp.size;
+    header.source_mtime = source.stamp.mtime;
+
+    // write to a temporary file and rename it,
+    // so a reader never maps a half-written dataset
+    std::string tmp_filename = filename + ".tmp";
+    std::ofstream file(tmp_filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open file " + tmp_filename);
+    }
+
+    // reserve the header, it is rewritten once the checksum is known
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    Checksum checksum;
+    std::array<uint64_t, 1> empty_offsets = {0};
+    if (offsets.empty()) {
+        write_section(file, checksum, empty_offsets.data(),
+                      sizeof(uint64_t));
+    } else {
+        write_section(file, checksum, offsets.data(),
+                      offsets.size_bytes());
+    }
+    write_section(file, checksum, all.cols.data(), all.cols.size_bytes());
+    write_section(file, checksum, all.vals.data(), all.vals.size_bytes());
+    write_section(file, checksum, users.data(), users.size_bytes());
+    write_section(file, checksum, items.data(), items.size_bytes());
+    for (const auto *section: {&stats.user_sums, &stats.user_counts,
+                               &stats.item_sums, &stats.item_counts}) {
+        write_section(file, checksum, section->data(),
+                      section->size() * sizeof(uint64_t));
+    }
+
+    header.payload_checksum = checksum.digest();
+    header.header_checksum = header_checksum(header);
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Cannot write file " + tmp_filename);
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tmp_filename, filename, error);
+    if (error) {
+        throw std::runtime_error("Cannot write file " + filename);
+    }
+}
+
+/**
+ * check the rows of CSR arrays, the matrix trusts them
+ * @param offsets row offsets, the first is 0 and the last is cols.size()
+ * @param cols
+ * @param col_count
+ * @return whether the offsets ascend and the cols of every row ascend
+ *         strictly and are less than col_count
+ */
+static bool valid_rows(std::span<const size_t> offsets,
+                       std::span<const uint32_t> cols, size_t col_count) {
+    for (size_t row = 0; row + 1 < offsets.size(); ++row) {
+        size_t begin = offsets[row];
+        size_t end = offsets[row + 1];
+        if (end < begin || end > cols.size()) {
+            return false;
+        }
+        for (size_t i = begin; i < end; ++i) {
+            if (cols[i] >= col_count ||
+                (i != begin && cols[i] <= cols[i - 1])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * read a delta segment of a mapped binary dataset, the segment is small
+ * so its checksum is always checked
+ * @param filename file name of the binary dataset, for errors
+ * @param base start of the mapped file
+ * @param size size of the mapped file
+ * @param pos offset of the segment
+ * @param dict id dictionary, the ids of the delta are added to it
+ * @param changes receives the ratings of the delta, in internal ids
+ * @return offset after the segment
+ */
+static size_t read_delta_segment(
+        const std::string &filename, const uint8_t *base, size_t size,
+        size_t pos, IdDictionary &dict,
+        std::vector<SparseMatrix<Rating>::Item> &changes) {
+    DeltaHeader header{};
+    if (pos > size || size - pos < sizeof(header)) {
+        throw std::runtime_error("Corrupt binary dataset: " + filename);
+    }
+    std::memcpy(&header, base + pos, sizeof(header));
+    DeltaLayout layout = get_delta_layout(header, size - pos);
+    const uint8_t *segment = base + pos;
+
+    Checksum checksum = delta_checksum(header);
+    checksum.update(segment + layout.users, layout.end - layout.users);
+    std::span<const size_t> users(
+            reinterpret_cast<const size_t *>(segment + layout.users),
+            header.user_count);
+    std::span<const size_t> items(
+            reinterpret_cast<const size_t *>(segment + layout.items),
+            header.item_count);
+    std::span<const size_t> offsets(
+            reinterpret_cast<const size_t *>(segment + layout.offsets),
+            header.row_count + 1);
+    std::span<const uint32_t> cols(
+            reinterpret_cast<const uint32_t *>(segment + layout.cols),
+            header.nnz);
+    std::span<const Rating> vals(
+            reinterpret_cast<const Rating *>(segment + layout.vals),
+            header.nnz);
+    if (checksum.digest() != header.checksum || offsets.front() != 0 ||
+        offsets.back() != header.nnz ||
+        header.row_count > header.user_count ||
+        !valid_rows(offsets, cols, header.item_count)) {
+        throw std::runtime_error("Corrupt binary dataset: " + filename);
+    }
+
+    // interning the users and then the items of the delta gives the ids
+    // that parsing the delta file after the dataset gives
+    std::vector<uint32_t> user_ids;
+    std::vector<uint32_t> item_ids;
+    user_ids.reserve(users.size());
+    item_ids.reserve(items.size());
+    for (size_t user: users) {
+        user_ids.emplace_back(dict.users.intern(user));
+    }
+    for (size_t item: items) {
+        item_ids.emplace_back(dict.items.intern(item));
+    }
+    for (size_t row = 0; row < header.row_count; ++row) {
+        for (size_t i = offsets[row]; i < offsets[row + 1]; ++i) {
+            changes.push_back({user_ids[row], item_ids[cols[i]], vals[i]});
+        }
+    }
+    return pos + layout.end;
+}
+
+SparseMatrix<Rating> read_binary_dataset(const std::string &filename,
+                                         IdDictionary &dict,
+                                         BinarySource *source,
+                                         RatingStats *stats,
+                                         bool verify) {
+    auto map = std::make_shared<MappedFile>(filename);
+    const auto *base = reinterpret_cast<const uint8_t *>(map->data());
+
+    Header header{};
+    if (map->size() < sizeof(header)) {
+        throw std::runtime_error("Not a binary dataset: " + filename);
+    }
+    std::memcpy(&header, base, sizeof(header));
+    if (header.magic != MAGIC) {
+        throw std::runtime_error("Not a binary dataset: " + filename);
+    }
+    if (header.version != VERSION || header.endian != ENDIAN_MARK ||
+        header.value_size != sizeof(Rating)) {
+        throw std::runtime_error(
+                "Unsupported binary dataset version: " + filename);
+    }
+    if (header.header_checksum != header_checksum(header)) {
+        throw std::runtime_error("Corrupt binary dataset: " + filename);
+    }
+
+    Layout layout = get_layout(header, map->size());
+    if (layout.end > map->size()) {
+        throw std::runtime_error("Corrupt binary dataset: " + filename);
+    }
+    std::span<const size_t> offsets(
+            reinterpret_cast<const size_t *>(base + layout.offsets),
+            header.row_count + 1);
+    std::span<const uint32_t> cols(
+            reinterpret_cast<const uint32_t *>(base + layout.cols),
+            header.nnz);
+    std::span<const Rating> vals(
+            reinterpret_cast<const Rating *>(base + layout.vals), header.nnz);
+    std::span<const size_t> users(
+            reinterpret_cast<const size_t *>(base + layout.users),
+            header.user_count);
+    std::span<const size_t> items(
+            reinterpret_cast<const size_t *>(base + layout.items),
+            header.item_count);
+
+    // a damaged index would crash the process, so the rows are always
+    // checked, every page of them is read by the first use anyway
+    if (offsets.front() != 0 || offsets.back() != header.nnz ||
+        header.row_count > header.user_count ||
+        !valid_rows(offsets, cols, header.item_count)) {
+        throw std::runtime_error("Corrupt binary dataset: " + filename);
+    }
+
+    // damaged values or stats only give wrong predictions,
+    // so the checksum is only computed on request
+    if (verify) {
+        Checksum checksum;
+        checksum.update(base + layout.offsets, layout.end - layout.offsets);
+        auto total = [&](size_t offset, size_t count) {
+            const auto *begin =
+                    reinterpret_cast<const uint64_t *>(base + offset);
+            return std::accumulate(begin, begin + count, uint64_t{0});
+        };
+        if (checksum.digest() != header.payload_checksum ||
+            total(layout.user_counts, header.user_count) != header.nnz ||
+            total(layout.item_counts, header.item_count) != header.nnz) {
+            throw std::runtime_error("Corrupt binary dataset: " + filename);
+        }
+    }
+
+    auto section = [&](size_t offset, size_t count) {
+        const auto *begin = reinterpret_cast<const uint64_t *>(base + offset);
+        return std::vector<uint64_t>(begin, begin + count);
+    };
+    RatingStats all_stats;
+    if (stats != nullptr || header.delta_count != 0) {
+        all_stats.user_sums = section(layout.user_sums, header.user_count);
+        all_stats.user_counts = section(layout.user_counts,
+                                        header.user_count);
+        all_stats.item_sums = section(layout.item_sums, header.item_count);
+        all_stats.item_counts = section(layout.item_counts,
+                                        header.item_count);
+    }
+
+    dict.users = IdMap(std::vector<size_t>(users.begin(), users.end()));
+    dict.items = IdMap(std::vector<size_t>(items.begin(), items.end()));
+    if (source != nullptr) {
+        source->stamp = {header.source_size, header.source_mtime};
+        source->merged = (header.flags & FLAG_MERGED) != 0;
+    }
+    auto mat = SparseMatrix<Rating>::from_csr(Buffer<size_t>(offsets, map),
+                                              Buffer<uint32_t>(cols, map),
+                                              Buffer<Rating>(vals, map));
+
+    if (header.delta_count != 0) {
+        // later segments replace the ratings of earlier ones
+        std::vector<SparseMatrix<Rating>::Item> changes;
+        changes.reserve(std::min<uint64_t>(header.delta_nnz, map->size()));
+        size_t pos = layout.end;
+        for (uint64_t i = 0; i < header.delta_count; ++i) {
+            pos = read_delta_segment(filename, base, map->size(), pos, dict,
+                                     changes);
+        }
+        SparseMatrix<Rating> delta(std::move(changes),
+                                   DuplicatePolicy::KEEP_LAST);
+        mat = merge_delta(mat, delta, dict, all_stats);
+    }
+    if (stats != nullptr) {
+        *stats = std::move(all_stats);
+    }
+    return mat;
+}
+
+/**
+ * read only the header of a binary dataset
+ * @param filename file name of the binary dataset
+ * @param header receives the header
+ * @return false if the file is missing, of another version or its header
+ *         is damaged
+ */
+static bool read_header(const std::string &filename, Header &header) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        return false;
+    }
+    return header.magic == MAGIC && header.version == VERSION &&
+           header.endian == ENDIAN_MARK &&
+           header.value_size == sizeof(Rating) &&
+           header.header_checksum == header_checksum(header);
+}
+
+/**
+ * whether a binary dataset is marked as holding merged deltas,
+ * only its header is read, so it also works on a damaged payload
+ * @param filename file name of the binary dataset
+ * @return false if the header cannot be read
+ */
+static bool holds_deltas(const std::string &filename) {
+    Header header{};
+    return read_header(filename, header) &&
+           (header.flags & FLAG_MERGED) != 0;
+}
+
+/**
+ * read train dataset through a binary cache, with its rating stats
+ * @param filename file name of the text dataset
+ * @param cache_filename file name of the binary dataset
+ * @param dict id dictionary, must be empty
+ * @param stats if not null, receives the rating stats
+ * @param verify check the whole cache, see read_binary_dataset()
+ * @return the dataset stored in SparseMatrix
+ */
+static SparseMatrix<Rating> read_cached(const std::string &filename,
+                                        const std::string &cache_filename,
+                                        IdDictionary &dict,
+                                        RatingStats *stats,
+                                        bool verify) {
+    SourceStamp stamp = get_source_stamp(filename);
+    if (std::filesystem::exists(cache_filename)) {
+        BinarySource cached;
+        try {
+            IdDictionary cached_dict;
+            auto mat = read_binary_dataset(cache_filename, cached_dict,
+                                           &cached, stats, verify);
+            if (cached.stamp == stamp) {
+                dict = std::move(cached_dict);
+                return mat;
+            }
+        } catch (const std::runtime_error &) {
+            // unreadable cache, rebuild it from the text file
+            // unless it holds deltas the text file does not have
+            if (holds_deltas(cache_filename)) {
+                throw;
+            }
+        }
+        if (cached.merged) {
+            throw std::runtime_error(
+                    "Train dataset changed after deltas were merged into " +
+                    cache_filename + ", remove the cache to rebuild it");
+        }
+    }
+
+    auto mat = read_train_dataset(filename, dict);
+    RatingStats new_stats = get_rating_stats(mat, dict);
+    write_binary_dataset(cache_filename, mat, dict, new_stats, {stamp});
+    if (stats != nullptr) {
+        *stats = std::move(new_stats);
+    }
+    return mat;
+}
+
+SparseMatrix<Rating> read_train_dataset_cached(
+        const std::string &filename, const std::string &cache_filename,
+        IdDictionary &dict, RatingStats &stats, bool verify) {
+    return read_cached(filename, cache_filename, dict, &stats, verify);
+}
+
+/**
+ * find where the delta segments of a binary dataset end,
+ * only the segment headers are read
+ * @param filename file name of the binary dataset
+ * @param header header of the dataset
+ * @return offset after the last segment counted in the header
+ */
+static size_t find_deltas_end(const std::string &filename,
+                              const Header &header) {
+    std::error_code error;
+    size_t file_size = std::filesystem::file_size(filename, error);
+    if (error) {
+        throw std::runtime_error("Cannot read file " + filename);
+    }
+    size_t pos = get_layout(header, file_size).end;
+    std::ifstream file(filename, std::ios::binary);
+    for (uint64_t i = 0; i < header.delta_count; ++i) {
+        DeltaHeader delta{};
+        if (pos > file_size || file_size - pos < sizeof(delta) ||
+            !file.seekg(static_cast<std::streamoff>(pos)) ||
+            !file.read(reinterpret_cast<char *>(&delta), sizeof(delta))) {
+            throw std::runtime_error("Corrupt binary dataset: " + filename);
+        }
+        pos += get_delta_layout(delta, file_size - pos).end;
+    }
+    if (pos > file_size) {
+        throw std::runtime_error("Corrupt binary dataset: " + filename);
+    }
+    return pos;
+}
+
+/**
+ * append a delta segment to a binary dataset and count it in the header
+ * @param filename file name of the binary dataset
+ * @param header header of the dataset, updated
+ * @param pos offset after the last segment, anything after it is
+ *            overwritten
+ * @param delta
+ * @param dict id dictionary of the delta alone
+ */
+static void append_delta(const std::string &filename, Header &header,
+                         size_t pos, const SparseMatrix<Rating> &delta,
+                         const IdDictionary &dict) {
+    // drop what an interrupted append left
+    std::error_code error;
+    std::filesystem::resize_file(filename, pos, error);
+    if (error) {
+        throw std::runtime_error("Cannot write file " + filename);
+    }
+
+    auto offsets = delta.offsets();
+    auto all = delta.get_all();
+    auto users = dict.users.external_ids();
+    auto items = dict.items.external_ids();
+
+    DeltaHeader segment{};
+    segment.magic = DELTA_MAGIC;
+    segment.row_count = offsets.empty() ? 0 : offsets.size() - 1;
+    segment.nnz = all.size();
+    segment.user_count = users.size();
+    segment.item_count = items.size();
+
+    // in and out opens the file without truncating it
+    std::ofstream file(filename,
+                       std::ios::binary | std::ios::in | std::ios::out);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open file " + filename);
+    }
+    file.seekp(static_cast<std::streamoff>(pos));
+    file.write(reinterpret_cast<const char *>(&segment), sizeof(segment));
+
+    Checksum checksum = delta_checksum(segment);
+    std::array<uint64_t, 1> empty_offsets = {0};
+    write_section(file, checksum, users.data(), users.size_bytes());
+    write_section(file, checksum, items.data(), items.size_bytes());
+    if (offsets.empty()) {
+        write_section(file, checksum, empty_offsets.data(),
+                      sizeof(uint64_t));
+    } else {
+        write_section(file, checksum, offsets.data(),
+                      offsets.size_bytes());
+    }
+    write_section(file, checksum, all.cols.data(), all.cols.size_bytes());
+    write_section(file, checksum, all.vals.data(), all.vals.size_bytes());
+
+    segment.checksum = checksum.digest();
+    file.seekp(static_cast<std::streamoff>(pos));
+    file.write(reinterpret_cast<const char *>(&segment), sizeof(segment));
+    file.flush();
+
+    // the segment counts once the header does
+    header.flags |= FLAG_MERGED;
+    ++header.delta_count;
+    header.delta_nnz += segment.nnz;
+    header.header_checksum = header_checksum(header);
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Cannot write file " + filename);
+    }
+}
+
+SparseMatrix<Rating> ingest_delta(const std::string &filename,
+                                  const std::string &cache_filename,
+                                  const std::string &delta_filename,
+                                  IdDictionary &dict) {
+    SourceStamp stamp = get_source_stamp(filename);
+    Header header{};
+    if (!read_header(cache_filename, header) ||
+        SourceStamp{header.source_size, header.source_mtime} != stamp) {
+        // build the cache first, this throws instead if it holds deltas
+        // the train dataset does not have
+        IdDictionary cached_dict;
+        read_cached(filename, cache_filename, cached_dict, nullptr, false);
+        if (!read_header(cache_filename, header)) {
+            throw std::runtime_error("Cannot read file " + cache_filename);
+        }
+    }
+
+    // only the delta is parsed and written, the dataset is not read
+    auto delta = read_train_dataset(delta_filename, dict);
+    append_delta(cache_filename, header,
+                 find_deltas_end(cache_filename, header), delta, dict);
+
+    // keep the stamp of the train dataset, the cache stays in use
+    // until the train dataset itself changes
+    if (header.delta_nnz * COMPACT_RATIO > header.nnz) {
+        IdDictionary merged_dict;
+        RatingStats stats;
+        auto merged = read_binary_dataset(cache_filename, merged_dict,
+                                          nullptr, &stats);
+        write_binary_dataset(cache_filename, merged, merged_dict, stats,
+                             {stamp, true});
+    }
+    return delta;
+}
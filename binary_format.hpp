@@ -0,0 +1,108 @@
+#ifndef RECOMMENDER_SYSTEM_BINARY_FORMAT_HPP
+#define RECOMMENDER_SYSTEM_BINARY_FORMAT_HPP
+
+#include <cstdint>
+#include <string>
+#include "core.hpp"
+
+/**
+ * identity of the text file a binary dataset was converted from,
+ * a binary dataset is stale once its source changes
+ */
+struct SourceStamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+
+    bool operator==(const SourceStamp &) const = default;
+};
+
+/**
+ * where the ratings of a binary dataset come from
+ */
+struct BinarySource {
+    // stamp of the text file the dataset was converted from
+    SourceStamp stamp;
+    // whether deltas were merged in since, then the text file alone
+    // cannot rebuild the dataset
+    bool merged = false;
+};
+
+/**
+ * get the stamp of a file
+ * @param filename
+ * @return size and modification time of the file
+ */
+SourceStamp get_source_stamp(const std::string &filename);
+
+/**
+ * write a rating matrix and its id dictionary as a binary dataset
+ * @param filename file name of the binary dataset
+ * @param mat
+ * @param dict
+ * @param stats rating sums and counts of mat
+ * @param source the text file the matrix was read from, and whether
+ *               deltas were merged in
+ */
+void write_binary_dataset(const std::string &filename,
+                          const SparseMatrix<Rating> &mat,
+                          const IdDictionary &dict,
+                          const RatingStats &stats,
+                          const BinarySource &source);
+
+/**
+ * map a binary dataset, the matrix views the mapped file without copying
+ * unless deltas were appended, then they are merged into a copy
+ * the row offsets and column indexes are checked, so a damaged file
+ * throws instead of crashing later
+ * @param filename file name of the binary dataset
+ * @param dict id dictionary, replaced by the one stored in the file
+ * @param source if not null, receives where the ratings come from
+ * @param stats if not null, receives the rating sums and counts
+ * @param verify also check the payload checksum and the rating counts,
+ *               reads the whole file
+ * @return the dataset stored in SparseMatrix
+ */
+SparseMatrix<Rating> read_binary_dataset(const std::string &filename,
+                                         IdDictionary &dict,
+                                         BinarySource *source = nullptr,
+                                         RatingStats *stats = nullptr,
+                                         bool verify = false);
+
+/**
+ * read train dataset through a binary cache
+ * map the cache if it is up to date, otherwise parse the text file
+ * and rewrite the cache
+ * a cache holding merged deltas is never rebuilt, if it is stale or
+ * unreadable this throws instead of dropping the deltas
+ * @param filename file name of the text dataset
+ * @param cache_filename file name of the binary dataset
+ * @param dict id dictionary, must be empty
+ * @param stats receives the rating sums and counts, stored in the cache
+ * @param verify check the whole cache, see read_binary_dataset()
+ * @return the dataset stored in SparseMatrix
+ */
+SparseMatrix<Rating> read_train_dataset_cached(
+        const std::string &filename, const std::string &cache_filename,
+        IdDictionary &dict, RatingStats &stats, bool verify = false);
+
+/**
+ * merge new and changed ratings into the binary cache of a train dataset
+ * the delta file has the format of the train dataset, it is appended to
+ * the cache without reading the ratings already there, and merged
+ * whenever the cache is read
+ * once the deltas hold a quarter as many ratings as the rest of the cache
+ * they are merged into it and the cache is rewritten, so over many deltas
+ * the cost stays proportional to their size
+ * @param filename file name of the text dataset, builds the cache
+ *                 if it is missing or stale
+ * @param cache_filename file name of the binary dataset
+ * @param delta_filename file name of the new and changed ratings
+ * @param dict id dictionary, must be empty, receives the ids of the delta
+ * @return the delta stored in SparseMatrix
+ */
+SparseMatrix<Rating> ingest_delta(const std::string &filename,
+                                  const std::string &cache_filename,
+                                  const std::string &delta_filename,
+                                  IdDictionary &dict);
+
+#endif //RECOMMENDER_SYSTEM_BINARY_FORMAT_HPP
@@ -0,0 +1,74 @@
+#ifndef RECOMMENDER_SYSTEM_BUFFER_HPP
+#define RECOMMENDER_SYSTEM_BUFFER_HPP
+
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+/**
+ * read-only array that either owns its elements
+ * or views memory owned by someone else (e.g. a mapped file)
+ * @tparam T
+ */
+template<typename T>
+class Buffer {
+public:
+    Buffer() = default;
+
+    /**
+     * constructor
+     * own the elements
+     * @param data
+     */
+    Buffer(std::vector<T> data) : owned(std::move(data)), view(owned) {}
+
+    /**
+     * constructor
+     * view elements kept alive by owner
+     * @param data
+     * @param owner
+     */
+    Buffer(std::span<const T> data, std::shared_ptr<const void> owner)
+            : view(data), owner(std::move(owner)) {}
+
+    Buffer(const Buffer &other)
+            : owned(other.owned), owner(other.owner) {
+        view = owner ? other.view : std::span<const T>(owned);
+    }
+
+    Buffer(Buffer &&other) noexcept
+            : owned(std::move(other.owned)), owner(std::move(other.owner)) {
+        view = owner ? other.view : std::span<const T>(owned);
+        other.view = {};
+    }
+
+    Buffer &operator=(Buffer other) noexcept {
+        owned = std::move(other.owned);
+        owner = std::move(other.owner);
+        view = owner ? other.view : std::span<const T>(owned);
+        other.view = {};
+        return *this;
+    }
+
+    const T *data() const { return view.data(); }
+
+    size_t size() const { return view.size(); }
+
+    bool empty() const { return view.empty(); }
+
+    const T &operator[](size_t i) const { return view[i]; }
+
+    const T *begin() const { return view.data(); }
+
+    const T *end() const { return view.data() + view.size(); }
+
+    const T &back() const { return view.back(); }
+
+private:
+    std::vector<T> owned;
+    std::span<const T> view;
+    std::shared_ptr<const void> owner;
+};
+
+#endif //RECOMMENDER_SYSTEM_BUFFER_HPP
@@ -0,0 +1,263 @@
+#ifndef RECOMMENDER_SYSTEM_COMPRESSED_MATRIX_HPP
+#define RECOMMENDER_SYSTEM_COMPRESSED_MATRIX_HPP
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <span>
+#include <optional>
+#include <utility>
+#include "sparse_matrix.hpp"
+#include "streamvbyte.hpp"
+
+/**
+ * sparse matrix with compressed column indexes
+ * each row is split into blocks of BLOCK_SIZE entries, the sorted column
+ * indexes of a block are delta-encoded with StreamVByte,
+ * values are stored as is
+ * @tparam T
+ */
+template<typename T>
+class CompressedSparseMatrix {
+public:
+    static constexpr size_t BLOCK_SIZE = 128;
+
+    using Row = typename SparseMatrix<T>::Row;
+
+    /**
+     * cursor over a row, decodes one block at a time
+     */
+    class RowCursor {
+    public:
+        RowCursor(const CompressedSparseMatrix *mat, size_t row)
+                : mat(mat) {
+            if (row + 1 < mat->row_offsets.size()) {
+                block = mat->row_blocks[row];
+                block_end = mat->row_blocks[row + 1];
+                pos = mat->row_offsets[row];
+                end = mat->row_offsets[row + 1];
+            }
+        }
+
+        /**
+         * decode the next block of the row
+         * the returned view is valid until the next call
+         * @return view of the block, empty at the end of the row
+         */
+        Row next() {
+            if (block == block_end) {
+                return {};
+            }
+            size_t count = std::min(BLOCK_SIZE, end - pos);
+            mat->decode_block(block, count, buffer.data());
+            Row result{std::span<const uint32_t>(buffer.data(), count),
+                       std::span<const T>(mat->vals).subspan(pos, count)};
+            ++block;
+            pos += count;
+            return result;
+        }
+
+    private:
+        const CompressedSparseMatrix *mat;
+        size_t block = 0;
+        size_t block_end = 0;
+        size_t pos = 0;
+        size_t end = 0;
+        std::array<uint32_t, BLOCK_SIZE> buffer;
+    };
+
+    /**
+     * constructor
+     * compress a sparse matrix, the source is released afterwards
+     * @param mat
+     */
+    explicit CompressedSparseMatrix(SparseMatrix<T> mat)
+            : rows(mat.row_indexes().begin(), mat.row_indexes().end()) {
+        size_t row_count = rows.empty() ? 0 : rows.back() + 1;
+        row_offsets.assign(row_count + 1, 0);
+        row_blocks.assign(row_count + 1, 0);
+        vals.reserve(mat.get_all().size());
+
+        size_t next_row = 0;
+        for (size_t row_id: rows) {
+            for (; next_row <= row_id; ++next_row) {
+                row_offsets[next_row] = vals.size();
+                row_blocks[next_row] = blocks.size();
+            }
+
+            Row row = mat.get_row(row_id);
+            for (size_t begin = 0; begin < row.size(); begin += BLOCK_SIZE) {
+                size_t count = std::min(BLOCK_SIZE, row.size() - begin);
+                std::span<const uint32_t> cols = row.cols.subspan(begin, count);
+                blocks.emplace_back(data.size(), cols.front(), cols.back());
+                svb_encode_delta(cols, cols.front(), data);
+            }
+            vals.insert(vals.end(), row.vals.begin(), row.vals.end());
+        }
+        for (; next_row <= row_count; ++next_row) {
+            row_offsets[next_row] = vals.size();
+            row_blocks[next_row] = blocks.size();
+        }
+        data.resize(data.size() + SVB_PADDING, 0);
+        data.shrink_to_fit();
+    }
+
+    /**
+     * get cursor over a row
+     * @param row
+     * @return cursor
+     */
+    RowCursor row_cursor(size_t row) const {
+        return RowCursor(this, row);
+    }
+
+    /**
+     * count of items of a row
+     * @param row
+     * @return count of items, 0 past the last row
+     */
+    size_t row_size(size_t row) const {
+        if (row + 1 >= row_offsets.size()) {
+            return 0;
+        }
+        return row_offsets[row + 1] - row_offsets[row];
+    }
+
+    /**
+     * transpose matrix
+     * counting sort by column, every row is decoded once to count and
+     * once to scatter, the transposed matrix is not compressed
+     * @return transposed matrix
+     */
+    SparseMatrix<T> transpose() const {
+        size_t col_count = 0;
+        for (const Block &block: blocks) {
+            col_count = std::max<size_t>(col_count, block.last_col + 1);
+        }
+
+        std::vector<size_t> offsets(col_count + 1, 0);
+        for (uint32_t row: rows) {
+            auto cursor = row_cursor(row);
+            for (Row block = cursor.next(); block.size() != 0;
+                 block = cursor.next()) {
+                for (uint32_t col: block.cols) {
+                    ++offsets[col + 1];
+                }
+            }
+        }
+        for (size_t col = 0; col < col_count; ++col) {
+            offsets[col + 1] += offsets[col];
+        }
+
+        // rows are visited in order so each column stays sorted
+        std::vector<size_t> position(offsets.begin(), offsets.end() - 1);
+        std::vector<uint32_t> transposed_cols(vals.size());
+        std::vector<T> transposed_vals(vals.size());
+        for (uint32_t row: rows) {
+            auto cursor = row_cursor(row);
+            for (Row block = cursor.next(); block.size() != 0;
+                 block = cursor.next()) {
+                for (const auto &item: block) {
+                    size_t p = position[item.col]++;
+                    transposed_cols[p] = row;
+                    transposed_vals[p] = item.val;
+                }
+            }
+        }
+        return SparseMatrix<T>::from_csr(std::move(offsets),
+                                         std::move(transposed_cols),
+                                         std::move(transposed_vals));
+    }
+
+    /**
+     * get item by row and col
+     * @param row
+     * @param col
+     * @return item, or nullopt if not exists
+     */
+    std::optional<T> get(size_t row, size_t col) const {
+        if (row + 1 >= row_offsets.size()) {
+            return std::nullopt;
+        }
+        // find the only block that may contain the column
+        auto first = blocks.begin() + row_blocks[row];
+        auto last = blocks.begin() + row_blocks[row + 1];
+        auto it = std::lower_bound(
+                first, last, col,
+                [](const Block &block, size_t col) {
+                    return block.last_col < col;
+                });
+        if (it == last || it->first_col > col) {
+            return std::nullopt;
+        }
+
+        // decode the block only up to the column
+        size_t index = it - first;
+        size_t pos = row_offsets[row] + index * BLOCK_SIZE;
+        size_t count = std::min(BLOCK_SIZE, row_offsets[row + 1] - pos);
+        size_t found = svb_find_delta(data.data() + it->data_offset, count,
+                                      it->first_col,
+                                      static_cast<uint32_t>(col));
+        if (found == count) {
+            return std::nullopt;
+        }
+        return vals[pos + found];
+    }
+
+    /**
+     * look up one column in many rows
+     * @param row_ids rows to look up
+     * @param col
+     * @param found (index in row_ids, value) of every row that has the
+     *              item, in the order of row_ids
+     * @return count of rows that have the item
+     */
+    size_t gather(std::span<const uint32_t> row_ids, size_t col,
+                  std::vector<std::pair<uint32_t, T>> &found) const {
+        found.clear();
+        for (size_t i = 0; i < row_ids.size(); ++i) {
+            if (auto val = get(row_ids[i], col)) {
+                found.emplace_back(static_cast<uint32_t>(i), *val);
+            }
+        }
+        return found.size();
+    }
+
+    /**
+     * get all row indexes
+     * @return view of all non-empty row indexes, in ascending order
+     */
+    std::span<const uint32_t> row_indexes() const {
+        return rows;
+    }
+
+    /**
+     * count of items
+     * @return count of items
+     */
+    size_t size() const {
+        return vals.size();
+    }
+
+private:
+    struct Block {
+        size_t data_offset;
+        uint32_t first_col;
+        uint32_t last_col;
+    };
+
+    void decode_block(size_t block, size_t count, uint32_t *out) const {
+        const Block &b = blocks[block];
+        svb_decode_delta(data.data() + b.data_offset, count, b.first_col, out);
+    }
+
+    std::vector<size_t> row_offsets;
+    std::vector<size_t> row_blocks;
+    std::vector<Block> blocks;
+    std::vector<uint8_t> data;
+    std::vector<T> vals;
+    std::vector<uint32_t> rows;
+};
+
+#endif //RECOMMENDER_SYSTEM_COMPRESSED_MATRIX_HPP
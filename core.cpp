@@ -1,161 +1,622 @@
 #include <fstream>
 #include <stdexcept>
-#include <map>
 #include <algorithm>
 #include <iostream>
 #include <vector>
 #include <array>
+#include <cmath>
+#include <optional>
+#include <atomic>
+#include <mutex>
+#include <unistd.h>
 #include <indicators/progress_bar.hpp>
 #include "core.hpp"
+#include "decompress.hpp"
+#include "dense.hpp"
+#include "intersect.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include "text_parser.hpp"
+#include "text_writer.hpp"
 
 using namespace indicators;
 
 using FpItem = SparseMatrix<double>::Item;
+using FpRow = SparseMatrix<double>::Row;
+using RatingItem = SparseMatrix<Rating>::Item;
+using RatingRow = SparseMatrix<Rating>::Row;
 using IntItem = SparseMatrix<int>::Item;
+using IntRow = SparseMatrix<int>::Row;
+using TopK = std::vector<std::pair<uint32_t, double>>;
 
 /**
- * read dataset from file in order (train or test)
- * @param filename file name of the dataset
+ * top-k similar users of a user, least similar first
+ */
+struct SimilarUsers {
+    std::vector<uint32_t> ids;
+    std::vector<double> scores;
+};
+
+using SimilarMat = std::vector<SimilarUsers>;
+
+/**
+ * convert a score read from file to rating
+ * @param score
+ * @return rating
+ */
+Rating to_rating(double score) {
+    if (!(0 <= score && score <= MAX_RATING) || score != std::floor(score)) {
+        std::string text;
+        append_number(text, score);
+        throw std::runtime_error(score != std::floor(score) ?
+                                 "Score is not an integer: " + text :
+                                 "Score out of range: " + text);
+    }
+    return static_cast<Rating>(score);
+}
+
+// smallest chunk of a dataset file worth a thread of its own
+constexpr size_t MIN_PARSE_CHUNK = 1 << 20;
+
+// decompressed text handed to a parser at a time
+constexpr size_t STREAM_PIECE = 4 << 20;
+
+/**
+ * parse a chunk of a dataset
+ * @param scanner scanner over the chunk
  * @param has_score whether the dataset has score
- * @return the dataset stored in vector
- */
-std::vector<FpItem> read_dataset_in_order(
-        const std::string &filename, bool has_score) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Cannot open file " + filename);
-    }
-    std::vector<FpItem> items;
-    char split;
-    size_t user_id, items_count;
-    while (!file.eof() &&
-           file >> user_id >> split >> items_count) {
-        for (size_t i = 0; i < items_count; ++i) {
-            size_t item_id;
-            double score;
-            file >> item_id;
-            if (has_score) {
-                file >> score;
-            } else {
-                score = 0;
+ * @param chunk chunk with begin set, receives ids, runs and end
+ * @param put put(pos, col, val) stores an entry in the dataset arrays
+ */
+template<typename Put>
+void parse_chunk(TextScanner &scanner, bool has_score, DatasetChunk &chunk,
+                 Put &&put) {
+    size_t last_user = 0;
+    chunk.end = chunk.begin;
+    parse_dataset(scanner, has_score,
+                  [&](size_t user_id, size_t item_id, double score) {
+                      if (chunk.runs.empty() || user_id != last_user) {
+                          chunk.runs.emplace_back(
+                                  chunk.users.intern(user_id), chunk.end);
+                          last_user = user_id;
+                      }
+                      put(chunk.end++, chunk.items.intern(item_id),
+                          to_rating(score));
+                  });
+}
+
+/**
+ * read a compressed file piece by piece, while it is decompressed on
+ * another thread, every piece ends at a record boundary
+ * @param filename
+ * @param split split(text) returns where the last, maybe incomplete,
+ *              record of the text begins
+ * @param parse parse(text, first_line) is called with every piece
+ */
+template<typename Split, typename Parse>
+void read_compressed(const std::string &filename, Split &&split,
+                     Parse &&parse) {
+    DecompressStream stream(filename);
+    std::string window;
+    size_t line = 1;
+    bool at_end = false;
+    while (!at_end) {
+        size_t size = window.size();
+        window.resize(size + STREAM_PIECE);
+        while (size < window.size()) {
+            size_t count = stream.read(window.data() + size,
+                                       window.size() - size);
+            if (count == 0) {
+                at_end = true;
+                break;
             }
-            items.emplace_back(user_id, item_id, score);
+            size += count;
+        }
+        window.resize(size);
+
+        // a record longer than the window needs another piece
+        size_t boundary = at_end ? window.size() : split(window);
+        if (boundary != 0) {
+            parse(std::string_view(window).substr(0, boundary), line);
+            line += std::count(window.begin(), window.begin() + boundary,
+                               '\n');
+            window.erase(0, boundary);
         }
     }
-    return items;
 }
 
 /**
- * read dataset from file (train or test)
+ * parse a mapped dataset file
+ * the file is split at record headers and the chunks are parsed in
+ * parallel, the headers are counted first, so entries are parsed
+ * straight into arrays of the final size
  * @param filename file name of the dataset
  * @param has_score whether the dataset has score
- * @return the dataset stored in SparseMatrix
+ * @return entries with chunk-local ids
+ */
+ParsedDataset read_chunks_mapped(const std::string &filename,
+                                 bool has_score) {
+    MappedFile file(filename);
+    std::string_view text = file.view();
+    auto bounds = split_dataset(
+            text, std::clamp<size_t>(text.size() / MIN_PARSE_CHUNK,
+                                     1, thread_count()));
+    ParsedDataset data;
+    data.chunks.resize(bounds.size() - 1);
+
+    std::vector<size_t> counts(data.chunks.size());
+    parallel_run(data.chunks.size(), [&](size_t t) {
+        counts[t] = count_dataset_entries(text, filename,
+                                          bounds[t], bounds[t + 1]);
+    });
+    size_t total = 0;
+    for (size_t t = 0; t < data.chunks.size(); ++t) {
+        data.chunks[t].begin = total;
+        total += counts[t];
+    }
+
+    data.cols.resize(total);
+    data.vals.resize(total);
+    parallel_run(data.chunks.size(), [&](size_t t) {
+        DatasetChunk &chunk = data.chunks[t];
+        size_t limit = chunk.begin + counts[t];
+        TextScanner scanner(text, filename, bounds[t], bounds[t + 1]);
+        parse_chunk(scanner, has_score, chunk,
+                    [&](size_t pos, uint32_t col, Rating val) {
+                        if (pos == limit) {
+                            throw std::runtime_error(
+                                    "more entries than the headers count");
+                        }
+                        data.cols[pos] = col;
+                        data.vals[pos] = val;
+                    });
+    });
+    return data;
+}
+
+/**
+ * parse a compressed dataset file, every piece is a chunk
+ * @param filename file name of the dataset
+ * @param has_score whether the dataset has score
+ * @return entries with chunk-local ids
+ */
+ParsedDataset read_chunks_compressed(const std::string &filename,
+                                     bool has_score) {
+    ParsedDataset data;
+    read_compressed(
+            filename, last_record_start,
+            [&](std::string_view text, size_t first_line) {
+                DatasetChunk &chunk = data.chunks.emplace_back();
+                chunk.begin = data.cols.size();
+                TextScanner scanner(text, filename, 0, text.size(),
+                                    first_line);
+                parse_chunk(scanner, has_score, chunk,
+                            [&](size_t, uint32_t col, Rating val) {
+                                data.cols.push_back(col);
+                                data.vals.push_back(val);
+                            });
+            });
+    return data;
+}
+
+/**
+ * parse dataset from file (train or test), plain or compressed
+ * @param filename file name of the dataset
+ * @param has_score whether the dataset has score
+ * @return entries with chunk-local ids
+ */
+ParsedDataset parse_dataset_file(const std::string &filename,
+                                 bool has_score) {
+    return DecompressStream::is_compressed(filename) ?
+           read_chunks_compressed(filename, has_score) :
+           read_chunks_mapped(filename, has_score);
+}
+
+/**
+ * parse train dataset from file (wrapper)
+ * @param filename file name of the dataset
+ * @return entries with chunk-local ids
  */
-SparseMatrix<double> read_dataset(const std::string &filename, bool has_score) {
-    return SparseMatrix<double>(read_dataset_in_order(filename, has_score));
+ParsedDataset parse_train_dataset(const std::string &filename) {
+    return parse_dataset_file(filename, true);
+}
+
+/**
+ * parse test dataset from file (wrapper)
+ * @param filename file name of the dataset
+ * @return entries with chunk-local ids
+ */
+ParsedDataset parse_test_dataset(const std::string &filename) {
+    return parse_dataset_file(filename, false);
+}
+
+/**
+ * add a parsed dataset to a dictionary
+ * the chunk dictionaries are merged in file order, so ids are the same
+ * as a sequential read, and the entries only need sorting within rows
+ * @param data parsed dataset
+ * @param dict id dictionary, new ids are added to it
+ * @param policy how to handle a (user, item) given twice,
+ *               KEEP_LAST for ratings, KEEP_ALL for queries
+ * @param order if not null, receives the order of the entries in the file
+ * @return the dataset stored in SparseMatrix, with internal ids
+ */
+SparseMatrix<Rating> intern_dataset(ParsedDataset data, IdDictionary &dict,
+                                    DuplicatePolicy policy,
+                                    QueryOrder *order) {
+    auto &chunks = data.chunks;
+    auto &cols = data.cols;
+    auto &vals = data.vals;
+
+    // interning the chunk-local ids chunk by chunk keeps
+    // the order of first appearance in the whole file
+    std::vector<std::vector<uint32_t>> user_ids(chunks.size());
+    std::vector<std::vector<uint32_t>> item_ids(chunks.size());
+    for (size_t t = 0; t < chunks.size(); ++t) {
+        for (size_t user_id: chunks[t].users.external_ids()) {
+            user_ids[t].push_back(dict.users.intern(user_id));
+        }
+        for (size_t item_id: chunks[t].items.external_ids()) {
+            item_ids[t].push_back(dict.items.intern(item_id));
+        }
+    }
+    size_t workers = std::min(chunks.size(), thread_count());
+    parallel_run(workers, [&](size_t w) {
+        for (size_t t = w; t < chunks.size(); t += workers) {
+            for (size_t pos = chunks[t].begin; pos < chunks[t].end; ++pos) {
+                cols[pos] = item_ids[t][cols[pos]];
+            }
+        }
+    });
+
+    // entries are stored in file order, so a run of a user in the file
+    // is a run of entries
+    if (order != nullptr) {
+        order->blocks.clear();
+        for (size_t t = 0; t < chunks.size(); ++t) {
+            for (auto [user, begin]: chunks[t].runs) {
+                uint32_t row = user_ids[t][user];
+                if (order->blocks.empty() ||
+                    order->blocks.back().first != row) {
+                    order->blocks.emplace_back(row, begin);
+                }
+            }
+        }
+    }
+
+    // users come in ascending order unless a user is split into
+    // blocks far apart, then the runs are already the rows of the matrix
+    std::vector<size_t> offsets;
+    bool grouped = true;
+    for (size_t t = 0; t < chunks.size() && grouped; ++t) {
+        for (auto [user, begin]: chunks[t].runs) {
+            size_t row = user_ids[t][user];
+            if (row + 1 < offsets.size()) {
+                grouped = false;
+                break;
+            }
+            offsets.resize(row + 1, begin);
+        }
+    }
+    if (grouped) {
+        offsets.push_back(cols.size());
+        return SparseMatrix<Rating>::from_unsorted_rows(
+                std::move(offsets), std::move(cols), std::move(vals),
+                policy, order ? &order->entries : nullptr);
+    }
+
+    // rows are scattered over the file, which is the common case for
+    // a test dataset, bucket the entries by row in one counting pass,
+    // runs are visited in file order, so every row keeps the file order
+    auto run_end = [&](size_t t, size_t r) {
+        const auto &runs = chunks[t].runs;
+        return r + 1 < runs.size() ? runs[r + 1].second : chunks[t].end;
+    };
+    size_t row_count = 0;
+    for (size_t t = 0; t < chunks.size(); ++t) {
+        for (auto [user, begin]: chunks[t].runs) {
+            row_count = std::max<size_t>(row_count, user_ids[t][user] + 1);
+        }
+    }
+    offsets.assign(row_count + 1, 0);
+    for (size_t t = 0; t < chunks.size(); ++t) {
+        const auto &runs = chunks[t].runs;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            offsets[user_ids[t][runs[r].first] + 1] +=
+                    run_end(t, r) - runs[r].second;
+        }
+    }
+    for (size_t row = 0; row < row_count; ++row) {
+        offsets[row + 1] += offsets[row];
+    }
+
+    std::vector<uint32_t> row_cols(cols.size());
+    std::vector<Rating> row_vals(cols.size());
+    std::vector<size_t> moved(order ? cols.size() : 0);
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t t = 0; t < chunks.size(); ++t) {
+        const auto &runs = chunks[t].runs;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            size_t &to = next[user_ids[t][runs[r].first]];
+            for (size_t pos = runs[r].second; pos < run_end(t, r); ++pos) {
+                row_cols[to] = cols[pos];
+                row_vals[to] = vals[pos];
+                if (order != nullptr) {
+                    moved[pos] = to;
+                }
+                ++to;
+            }
+        }
+    }
+    cols = {};
+    vals = {};
+
+    std::vector<size_t> positions;
+    auto mat = SparseMatrix<Rating>::from_unsorted_rows(
+            std::move(offsets), std::move(row_cols), std::move(row_vals),
+            policy, order ? &positions : nullptr);
+    if (order != nullptr) {
+        order->entries.resize(moved.size());
+        for (size_t pos = 0; pos < moved.size(); ++pos) {
+            order->entries[pos] = positions[moved[pos]];
+        }
+    }
+    return mat;
 }
 
 /**
  * read train dataset from file (wrapper)
  * @param filename file name of the dataset
+ * @param dict id dictionary, new ids are added to it
  * @return the dataset stored in SparseMatrix
  */
-SparseMatrix<double> read_train_dataset(const std::string &filename) {
-    return read_dataset(filename, true);
+SparseMatrix<Rating> read_train_dataset(const std::string &filename,
+                                        IdDictionary &dict) {
+    return intern_dataset(parse_train_dataset(filename), dict,
+                          DuplicatePolicy::KEEP_LAST);
 }
 
 /**
  * read test dataset from file (wrapper)
  * @param filename file name of the dataset
+ * @param dict id dictionary, new ids are added to it
+ * @param order if not null, receives the order of the queries in the file
  * @return the dataset stored in SparseMatrix
  */
-SparseMatrix<double> read_test_dataset(const std::string &filename) {
-    return read_dataset(filename, false);
+SparseMatrix<Rating> read_test_dataset(const std::string &filename,
+                                       IdDictionary &dict,
+                                       QueryOrder *order) {
+    return intern_dataset(parse_test_dataset(filename), dict,
+                          DuplicatePolicy::KEEP_ALL, order);
+}
+
+/**
+ * count an id into CSR offsets that are not summed up yet
+ * @param offsets count of id is kept at offsets[id + 1]
+ * @param id
+ */
+void count_id(std::vector<size_t> &offsets, size_t id) {
+    if (offsets.size() < id + 2) {
+        offsets.resize(id + 2, 0);
+    }
+    ++offsets[id + 1];
 }
 
 /**
- * read item attribute from file
+ * parse item attribute from file, plain or compressed
  * @param filename file name of the item attribute
- * @return item attribute stored in SparseMatrix, '1' for attribute exists
- */
-SparseMatrix<int> read_item_attribute(const std::string &filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Cannot open file " + filename);
-    }
-
-    std::vector<IntItem> items;
-    size_t item_id;
-    std::string line;
-    while (!file.eof()) {
-        char split;
-        file >> item_id >> split;
-        std::getline(file, line);
-        if (line.empty()) {
-            continue;
-        }
-        auto pos = line.find_first_of('|');
-        if (pos == std::string::npos) {
-            throw std::runtime_error("Item attribute file format error");
+ * @return (item, attribute) pairs with file-local item ids
+ */
+ParsedAttributes parse_item_attribute_file(const std::string &filename) {
+    ParsedAttributes parsed;
+    auto on_item = [&](size_t item_id, std::optional<uint32_t> attr1,
+                       std::optional<uint32_t> attr2) {
+        uint32_t item = parsed.items.intern(item_id);
+        for (auto attr: {attr1, attr2}) {
+            if (attr) {
+                parsed.pairs.emplace_back(item, *attr);
+            }
         }
-        std::string attr1_str = line.substr(0, pos);
-        std::string attr2_str = line.substr(pos + 1);
+    };
 
-        if (attr1_str != "None") {
-            items.emplace_back(item_id, std::stoi(attr1_str), 1);
-        }
-        if (attr2_str != "None") {
-            items.emplace_back(item_id, std::stoi(attr2_str), 1);
+    if (DecompressStream::is_compressed(filename)) {
+        // every line is a record
+        auto last_line_start = [](std::string_view text) {
+            size_t newline = text.rfind('\n');
+            return newline == std::string_view::npos ? 0 : newline + 1;
+        };
+        read_compressed(filename, last_line_start,
+                        [&](std::string_view text, size_t first_line) {
+                            TextScanner scanner(text, filename, 0,
+                                                text.size(), first_line);
+                            parse_item_attribute(scanner, on_item);
+                        });
+    } else {
+        MappedFile file(filename);
+        TextScanner scanner(file.view(), filename);
+        parse_item_attribute(scanner, on_item);
+    }
+    return parsed;
+}
+
+/**
+ * add parsed item attributes to a dictionary
+ * items and attributes are counted first, so both indexes are
+ * filled by one scatter instead of transposing
+ * @param parsed parsed item attributes
+ * @param dict id dictionary, new item ids are added to it
+ * @return item attribute indexed by item and by attribute,
+ *         '1' for attribute exists
+ */
+DualSparseMatrix<int> intern_item_attribute(ParsedAttributes parsed,
+                                            IdDictionary &dict) {
+    std::vector<uint32_t> item_ids;
+    for (size_t item_id: parsed.items.external_ids()) {
+        item_ids.push_back(dict.items.intern(item_id));
+    }
+
+    std::vector<size_t> item_offsets = {0};
+    std::vector<size_t> attr_offsets = {0};
+    for (auto &[item, attr]: parsed.pairs) {
+        item = item_ids[item];
+        count_id(item_offsets, item);
+        count_id(attr_offsets, attr);
+    }
+    for (size_t i = 1; i < item_offsets.size(); ++i) {
+        item_offsets[i] += item_offsets[i - 1];
+    }
+    for (size_t i = 1; i < attr_offsets.size(); ++i) {
+        attr_offsets[i] += attr_offsets[i - 1];
+    }
+
+    size_t count = parsed.pairs.size();
+    std::vector<uint32_t> item_cols(count);
+    std::vector<uint32_t> attr_cols(count);
+    std::vector<size_t> item_pos(item_offsets.begin(), item_offsets.end() - 1);
+    std::vector<size_t> attr_pos(attr_offsets.begin(), attr_offsets.end() - 1);
+    for (auto [item, attr]: parsed.pairs) {
+        item_cols[item_pos[item]++] = attr;
+        attr_cols[attr_pos[attr]++] = item;
+    }
+    parsed = {};
+
+    // rows are filled in file order and only sorted within,
+    // "id|a|a" lists the attribute twice, and both entries take part in
+    // finding similar items
+    return DualSparseMatrix<int>(
+            SparseMatrix<int>::from_unsorted_rows(
+                    std::move(item_offsets), std::move(item_cols),
+                    std::vector<int>(count, 1), DuplicatePolicy::KEEP_ALL),
+            SparseMatrix<int>::from_unsorted_rows(
+                    std::move(attr_offsets), std::move(attr_cols),
+                    std::vector<int>(count, 1), DuplicatePolicy::KEEP_ALL));
+}
+
+/**
+ * read item attribute from file (wrapper)
+ * @param filename file name of the item attribute
+ * @param dict id dictionary, new item ids are added to it
+ * @return item attribute indexed by item and by attribute,
+ *         '1' for attribute exists
+ */
+DualSparseMatrix<int> read_item_attribute(const std::string &filename,
+                                      IdDictionary &dict) {
+    return intern_item_attribute(parse_item_attribute_file(filename), dict);
+}
+
+/**
+ * count rating sums of every user and item
+ * @param mat dataset
+ * @param dict id dictionary, gives the size of the user and item id spaces
+ * @return rating sums and counts
+ */
+RatingStats get_rating_stats(const SparseMatrix<Rating> &mat,
+                             const IdDictionary &dict) {
+    RatingStats stats;
+    stats.resize(dict.users.size(), dict.items.size());
+    for (uint32_t user: mat.row_indexes()) {
+        for (const auto &item: mat.get_row(user)) {
+            stats.user_sums[user] += item.val;
+            ++stats.user_counts[user];
+            stats.item_sums[item.col] += item.val;
+            ++stats.item_counts[item.col];
         }
     }
-    return SparseMatrix<int>(items);
+    return stats;
+}
+
+/**
+ * merge new and changed ratings into a dataset
+ * only the users in delta are merged and only their ratings update
+ * the stats, the other users are copied as is
+ * @param mat dataset
+ * @param delta new and changed ratings, with ids of the same dictionary
+ * @param dict id dictionary, gives the size of the user and item id spaces
+ * @param stats rating sums and counts of mat, updated to the result
+ * @return merged dataset
+ */
+SparseMatrix<Rating> merge_delta(const SparseMatrix<Rating> &mat,
+                                 const SparseMatrix<Rating> &delta,
+                                 const IdDictionary &dict,
+                                 RatingStats &stats) {
+    stats.resize(dict.users.size(), dict.items.size());
+    return mat.merge(delta, [&](size_t user, uint32_t item,
+                                std::optional<Rating> old_score,
+                                Rating score) {
+        if (old_score) {
+            stats.user_sums[user] -= *old_score;
+            stats.item_sums[item] -= *old_score;
+        } else {
+            ++stats.user_counts[user];
+            ++stats.item_counts[item];
+        }
+        stats.user_sums[user] += score;
+        stats.item_sums[item] += score;
+    });
 }
 
 /**
  * write result to file
  * @param filename file name of the result
  * @param mat result stored in SparseMatrix
+ * @param dict id dictionary to restore external ids
  */
 void write_dataset(const std::string &filename,
-                   const SparseMatrix<double> &mat) {
-
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Cannot open file " + filename);
-    }
-
-    for (size_t row_id: mat.row_indexes()) {
-        std::span<const FpItem> row = mat.get_row(row_id);
-        file << row_id << "|" << row.size() << std::endl;
+                   const SparseMatrix<double> &mat,
+                   const IdDictionary &dict) {
+    auto row_ids = mat.row_indexes();
+    write_blocks(filename, row_ids.size(), [&](size_t i, std::string &out) {
+        FpRow row = mat.get_row(row_ids[i]);
+        append_number(out, dict.users.external(row_ids[i]));
+        out += '|';
+        append_number(out, row.size());
+        out += '\n';
         for (const auto &item: row) {
-            file << item.col << "  " << item.val << std::endl;
+            append_number(out, dict.items.external(item.col));
+            out += "  ";
+            append_number(out, item.val);
+            out += '\n';
         }
-    }
+    });
 }
 
 /**
  * write result to file in order
- * @param reference reference file name
+ * @param order order of the queries in the test file
  * @param filename file name of the result
- * @param mat result stored in SparseMatrix
+ * @param mat result stored in SparseMatrix, with the entries of the
+ *            test dataset the order was read with
+ * @param dict id dictionary to restore external ids
  */
-void write_dataset_in_order(const std::string &reference,
+void write_dataset_in_order(const QueryOrder &order,
                             const std::string &filename,
-                            const SparseMatrix<double> &mat) {
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Cannot open file " + filename);
+                            const SparseMatrix<double> &mat,
+                            const IdDictionary &dict) {
+    FpRow all = mat.get_all();
+    if (std::any_of(order.entries.begin(), order.entries.end(),
+                    [&](size_t entry) { return entry >= all.size(); })) {
+        throw std::runtime_error("Result does not match the test dataset");
     }
 
-    std::vector<FpItem> queries = read_dataset_in_order(reference, false);
-    size_t prev = std::numeric_limits<size_t>::max();
-    for (auto [user_id, item_id, _]: queries) {
-        if (user_id != prev) {
-            prev = user_id;
-            file << user_id << "|" << mat.get_row(user_id).size() << std::endl;
-        }
-        file << item_id << "  " << mat.get(user_id, item_id) << std::endl;
-    }
+    write_blocks(filename, order.blocks.size(),
+                 [&](size_t b, std::string &out) {
+                     auto [user, first] = order.blocks[b];
+                     size_t last = b + 1 < order.blocks.size() ?
+                                   order.blocks[b + 1].second :
+                                   order.entries.size();
+                     append_number(out, dict.users.external(user));
+                     out += '|';
+                     append_number(out, last - first);
+                     out += '\n';
+                     for (size_t i = first; i < last; ++i) {
+                         size_t entry = order.entries[i];
+                         append_number(out, dict.items.external(
+                                 all.cols[entry]));
+                         out += "  ";
+                         append_number(out, all.vals[entry]);
+                         out += '\n';
+                     }
+                 });
 }
 
 /**
@@ -164,17 +625,17 @@ void write_dataset_in_order(const std::string &reference,
  * @param test_count count of test items for each user
  * @return train and test dataset
  */
-std::pair<SparseMatrix<double>, SparseMatrix<double>> make_train_test(
-        const SparseMatrix<double> &mat, size_t test_count) {
-    std::vector<FpItem> train_items;
-    std::vector<FpItem> test_items;
+std::pair<SparseMatrix<Rating>, SparseMatrix<Rating>> make_train_test(
+        const SparseMatrix<Rating> &mat, size_t test_count) {
+    std::vector<RatingItem> train_items;
+    std::vector<RatingItem> test_items;
 
     // the answer to life, the universe and everything
     srand(42);
     size_t seed = rand();
 
     for (size_t row_id: mat.row_indexes()) {
-        std::span<const FpItem> row = mat.get_row(row_id);
+        RatingRow row = mat.get_row(row_id);
         if (row.size() <= test_count) {
             continue;
         }
@@ -183,104 +644,332 @@ std::pair<SparseMatrix<double>, SparseMatrix<double>> make_train_test(
             size_t next_i = i + row.size();
             size_t base = seed % row.size();
 
+            RatingItem item{static_cast<uint32_t>(row_id),
+                            row.cols[i], row.vals[i]};
             if ((base <= i && i < base + test_count) ||
                 (base <= next_i && next_i < base + test_count)) {
-                test_items.emplace_back(row[i]);
+                test_items.emplace_back(item);
             } else {
-                train_items.emplace_back(row[i]);
+                train_items.emplace_back(item);
             }
         }
 
     }
-    return {SparseMatrix<double>(train_items),
-            SparseMatrix<double>(test_items)};
+    return {SparseMatrix<Rating>(std::move(train_items)),
+            SparseMatrix<Rating>(std::move(test_items))};
+}
+
+template<typename T>
+inline T square(T x) { return x * x; }
+
+/**
+ * dot product of two centered rows, or of ranges of them
+ * @param a ratings of the first row
+ * @param a_avg average score of the first row
+ * @param b ratings of the second row
+ * @param b_avg average score of the second row
+ * @param sum the products are added to it
+ * @return sum of products of the centered columns of both rows
+ */
+double centered_dot(RatingRow a, double a_avg, RatingRow b, double b_avg,
+                    double sum = 0) {
+    return centered_dot(a.cols, a.vals.data(), a_avg,
+                        b.cols, b.vals.data(), b_avg, sum);
 }
 
 /**
- * get average score for each row (user / item)
- * @param mat dataset
- * @return average score for each row (represented by map)
+ * the heaviest rows times the most popular columns of the centered rows,
+ * multiplied as a dense matrix instead of row pair by row pair
  */
-std::map<size_t, double> get_avg_score_by_row(const SparseMatrix<double> &mat) {
-    std::map<size_t, double> avg_score;
-    for (const auto &row_id: mat.row_indexes()) {
-        double sum = 0;
-        size_t count = 0;
-        for (const auto &item: mat.get_row(row_id)) {
-            sum += item.val;
-            ++count;
-        }
-        avg_score[row_id] = sum / count;
+struct DenseBlock {
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    // row id of every slot, ascending
+    std::vector<uint32_t> rows;
+    // average score of every slot
+    std::vector<double> avgs;
+    // slot of every row id, NO_SLOT if not in the block
+    std::vector<uint32_t> slots;
+    // whether every column is in the block
+    std::vector<bool> cols;
+    // ratings of every slot without the block columns, in CSR form
+    std::vector<size_t> rest_offsets = {0};
+    std::vector<uint32_t> rest_cols;
+    std::vector<Rating> rest_vals;
+    // numerators over the block columns of every pair of slots
+    std::vector<double> gram;
+
+    /**
+     * whether a row is in the block
+     * @param row row id
+     * @return false for every row if the block is empty
+     */
+    bool contains(size_t row) const {
+        return row < slots.size() && slots[row] != NO_SLOT;
+    }
+
+    /**
+     * ratings of a slot without the block columns
+     * @param slot
+     * @return view of the ratings
+     */
+    RatingRow rest(size_t slot) const {
+        size_t begin = rest_offsets[slot];
+        size_t size = rest_offsets[slot + 1] - begin;
+        return {std::span<const uint32_t>(rest_cols).subspan(begin, size),
+                std::span<const Rating>(rest_vals).subspan(begin, size)};
+    }
+
+    /**
+     * numerator of pearson() for two rows of the block
+     * the other columns are summed in column order, then the block columns
+     * are added at once, so the score may differ from pearson() of the
+     * plain rows in the last bits
+     * @param x the first row
+     * @param y the second row
+     * @return sum of products of the centered columns of both rows
+     */
+    double numerator(size_t x, size_t y) const {
+        size_t a = slots[x];
+        size_t b = slots[y];
+        return centered_dot(rest(a), avgs[a], rest(b), avgs[b]) +
+               gram[a * rows.size() + b];
+    }
+};
+
+/**
+ * the terms of pearson() that only depend on one row
+ * a rating is centered where it is used, as rating - avg_score[row],
+ * which is the same double as centering it beforehand, so the engines
+ * read the rows of the dataset as they are stored
+ */
+struct PearsonTerms {
+    // average score of every row
+    const std::vector<double> &avg_score;
+    // sum of squares of every centered row, summed in column order
+    std::vector<double> sum_squares;
+    // dense part of the rows, empty unless FEAT_DENSE_BLOCK
+    DenseBlock block;
+};
+
+/**
+ * call a function with every block of a row, in column order
+ * a plain row is a single block, a compressed row is decoded a block
+ * at a time
+ * @param mat dataset (SparseMatrix or CompressedSparseMatrix)
+ * @param row
+ * @param on_block on_block(RatingRow) is called with every block
+ */
+template<typename Matrix, typename F>
+void for_each_block(const Matrix &mat, size_t row, F &&on_block) {
+    auto cursor = mat.row_cursor(row);
+    for (RatingRow block = cursor.next(); block.size() != 0;
+         block = cursor.next()) {
+        on_block(block);
     }
-    return avg_score;
 }
 
 /**
- * get average score for the whole dataset
- * @param mat dataset
- * @return average score
+ * sum the terms of pearson() that only depend on one row
+ * the denominator of pearson() only depends on the two rows on their own,
+ * so it is summed once per row instead of once per pair
+ * @param mat dataset (SparseMatrix or CompressedSparseMatrix)
+ * @param avg_score cached average score for each row, viewed by the result
+ * @param row_count size of the id space
+ * @return pearson terms, without dense block
  */
-double get_global_avg_score(const SparseMatrix<double> &mat) {
-    double sum = 0;
-    size_t count = 0;
-    for (const auto &item: mat.get_all()) {
-        sum += item.val;
-        ++count;
+template<typename Matrix>
+PearsonTerms get_pearson_terms(const Matrix &mat,
+                               const std::vector<double> &avg_score,
+                               size_t row_count) {
+    std::vector<double> sum_squares(row_count, 0);
+    for (uint32_t row_id: mat.row_indexes()) {
+        double avg = avg_score[row_id];
+        for_each_block(mat, row_id, [&](RatingRow block) {
+            for (Rating val: block.vals) {
+                sum_squares[row_id] += square(val - avg);
+            }
+        });
     }
-    return sum / count;
+    return {avg_score, std::move(sum_squares), {}};
 }
 
-template<typename T>
-inline T square(T x) { return x * x; }
+/**
+ * rows of a run of row ids, loaded to be read many times
+ */
+struct RowRun {
+    // every row of the run, in the order of the row ids
+    std::vector<RatingRow> rows;
+    // decoded rows of a compressed dataset, in CSR form
+    std::vector<size_t> ends;
+    std::vector<uint32_t> cols;
+    std::vector<Rating> vals;
+};
 
 /**
- * calculate pearson correlation between two rows (user / item)
+ * load the rows of a run of row ids, viewed in place
  * @param mat dataset
- * @param x the first row
- * @param y the second row
- * @param avg_score cached average score for each row
- * @return pearson correlation between two rows
+ * @param row_ids
+ * @param run receives the rows
  */
-double pearson(const SparseMatrix<double> &mat, size_t x, size_t y,
-               const std::map<size_t, double> &avg_score) {
-    std::span<const FpItem> row_x = mat.get_row(x);
-    std::span<const FpItem> row_y = mat.get_row(y);
-    double avg_x = avg_score.at(x);
-    double avg_y = avg_score.at(y);
+void load_rows(const SparseMatrix<Rating> &mat,
+               std::span<const uint32_t> row_ids, RowRun &run) {
+    run.rows.clear();
+    for (uint32_t row_id: row_ids) {
+        run.rows.emplace_back(mat.get_row(row_id));
+    }
+}
 
-    size_t i = 0;
-    size_t j = 0;
-    double numerator = 0;
-    double denominator_x = 0;
-    double denominator_y = 0;
-    while (i < row_x.size() && j < row_y.size()) {
-        if (row_x[i].col < row_y[j].col) {
-            denominator_x += square(row_x[i].val - avg_x);
-            ++i;
-        } else if (row_x[i].col > row_y[j].col) {
-            denominator_y += square(row_y[j].val - avg_y);
-            ++j;
-        } else {
-            numerator += (row_x[i].val - avg_x) * (row_y[j].val - avg_y);
-            denominator_x += square(row_x[i].val - avg_x);
-            denominator_y += square(row_y[j].val - avg_y);
-            ++i;
-            ++j;
-        }
+/**
+ * load the rows of a run of row ids, decoded into the buffers of the run
+ * @param mat dataset
+ * @param row_ids
+ * @param run receives the rows, valid until it is loaded again
+ */
+void load_rows(const CompressedSparseMatrix<Rating> &mat,
+               std::span<const uint32_t> row_ids, RowRun &run) {
+    run.ends.clear();
+    run.cols.clear();
+    run.vals.clear();
+    for (uint32_t row_id: row_ids) {
+        for_each_block(mat, row_id, [&](RatingRow block) {
+            run.cols.insert(run.cols.end(), block.cols.begin(),
+                            block.cols.end());
+            run.vals.insert(run.vals.end(), block.vals.begin(),
+                            block.vals.end());
+        });
+        run.ends.emplace_back(run.cols.size());
+    }
+
+    run.rows.clear();
+    std::span<const uint32_t> cols = run.cols;
+    std::span<const Rating> vals = run.vals;
+    size_t begin = 0;
+    for (size_t end: run.ends) {
+        run.rows.push_back({cols.subspan(begin, end - begin),
+                            vals.subspan(begin, end - begin)});
+        begin = end;
+    }
+}
+
+// most rows and columns of the dense block
+constexpr size_t DENSE_BLOCK_ROWS = 1024;
+constexpr size_t DENSE_BLOCK_COLS = 1024;
+// fewest rows worth a dense block
+constexpr size_t DENSE_BLOCK_MIN_ROWS = 64;
+// least share of the block that holds ratings,
+// below it the sparse kernels do less work
+constexpr double DENSE_BLOCK_FILL = 0.125;
+
+/**
+ * find the dense block of the rows
+ * the rows with the most columns times the columns in the most rows,
+ * both halved until enough of the block holds ratings
+ * @param mat dataset (SparseMatrix or CompressedSparseMatrix)
+ * @param terms pearson terms, gives the average scores
+ * @param row_count size of the id space
+ * @return dense block, empty if none is dense enough
+ */
+template<typename Matrix>
+DenseBlock make_dense_block(const Matrix &mat, const PearsonTerms &terms,
+                            size_t row_count) {
+    std::span<const uint32_t> row_ids = mat.row_indexes();
+    std::vector<size_t> col_sizes;
+    for (uint32_t row_id: row_ids) {
+        for_each_block(mat, row_id, [&](RatingRow block) {
+            if (col_sizes.size() <= block.cols.back()) {
+                col_sizes.resize(block.cols.back() + 1, 0);
+            }
+            for (uint32_t col: block.cols) {
+                ++col_sizes[col];
+            }
+        });
     }
-    if (i != row_x.size()) {
-        while (i < row_x.size()) {
-            denominator_x += square(row_x[i].val - avg_x);
-            ++i;
+    auto col_count = static_cast<uint32_t>(col_sizes.size());
+
+    std::vector<uint32_t> heavy_rows(row_ids.begin(), row_ids.end());
+    std::stable_sort(heavy_rows.begin(), heavy_rows.end(),
+                     [&](uint32_t a, uint32_t b) {
+                         return mat.row_size(a) > mat.row_size(b);
+                     });
+    std::vector<uint32_t> popular_cols(col_count);
+    for (uint32_t col = 0; col < col_count; ++col) {
+        popular_cols[col] = col;
+    }
+    std::stable_sort(popular_cols.begin(), popular_cols.end(),
+                     [&](uint32_t a, uint32_t b) {
+                         return col_sizes[a] > col_sizes[b];
+                     });
+
+    DenseBlock block;
+    size_t n = std::min(DENSE_BLOCK_ROWS, heavy_rows.size());
+    size_t m = std::min<size_t>(DENSE_BLOCK_COLS, col_count);
+    for (; n >= DENSE_BLOCK_MIN_ROWS && m != 0; n /= 2, m /= 2) {
+        block.cols.assign(col_count, false);
+        for (size_t c = 0; c < m; ++c) {
+            block.cols[popular_cols[c]] = true;
+        }
+        size_t filled = 0;
+        for (size_t r = 0; r < n; ++r) {
+            for_each_block(mat, heavy_rows[r], [&](RatingRow row) {
+                for (uint32_t col: row.cols) {
+                    filled += block.cols[col];
+                }
+            });
         }
+        if (filled >= DENSE_BLOCK_FILL * static_cast<double>(n * m)) {
+            break;
+        }
+    }
+    if (n < DENSE_BLOCK_MIN_ROWS || m == 0) {
+        return {};
     }
-    if (j != row_y.size()) {
-        while (j < row_y.size()) {
-            denominator_y += square(row_y[j].val - avg_y);
-            ++j;
+
+    block.rows.assign(heavy_rows.begin(), heavy_rows.begin() + n);
+    std::sort(block.rows.begin(), block.rows.end());
+    block.slots.assign(row_count, DenseBlock::NO_SLOT);
+    // block columns in column order
+    std::vector<uint32_t> col_index(col_count, 0);
+    for (uint32_t col = 0, index = 0; col < col_count; ++col) {
+        if (block.cols[col]) {
+            col_index[col] = index++;
         }
     }
-    double denominator = std::sqrt(denominator_x * denominator_y);
+
+    std::vector<double> dense(n * m, 0);
+    for (size_t slot = 0; slot < n; ++slot) {
+        uint32_t row_id = block.rows[slot];
+        double avg = terms.avg_score[row_id];
+        block.slots[row_id] = static_cast<uint32_t>(slot);
+        block.avgs.emplace_back(avg);
+        for_each_block(mat, row_id, [&](RatingRow row) {
+            for (const auto &item: row) {
+                if (block.cols[item.col]) {
+                    dense[slot * m + col_index[item.col]] = item.val - avg;
+                } else {
+                    block.rest_cols.emplace_back(item.col);
+                    block.rest_vals.emplace_back(item.val);
+                }
+            }
+        });
+        block.rest_offsets.emplace_back(block.rest_cols.size());
+    }
+    block.gram = gram_matrix(dense, n, m);
+    return block;
+}
+
+/**
+ * finish pearson correlation from its numerator
+ * @param terms pearson terms
+ * @param x the first row
+ * @param y the second row
+ * @param numerator sum of products of the centered columns of both rows
+ * @return pearson correlation between two rows
+ */
+double pearson_from_numerator(const PearsonTerms &terms,
+                              size_t x, size_t y, double numerator) {
+    double denominator = std::sqrt(terms.sum_squares[x] *
+                                   terms.sum_squares[y]);
     if (std::abs(denominator) < std::numeric_limits<double>::epsilon()) {
         return 0;
     }
@@ -288,15 +977,42 @@ double pearson(const SparseMatrix<double> &mat, size_t x, size_t y,
 }
 
 /**
- * comparator for the top-k top-k items with highest score
+ * calculate pearson correlation between two rows (user / item)
+ * only the columns of both rows add to the numerator
+ * two rows of the dense block take their numerator from it
+ * @param terms pearson terms
+ * @param x the first row id
+ * @param row_x ratings of the first row
+ * @param y the second row id
+ * @param row_y ratings of the second row
+ * @return pearson correlation between two rows
+ */
+double pearson(const PearsonTerms &terms, size_t x, RatingRow row_x,
+               size_t y, RatingRow row_y) {
+    if (terms.block.contains(x) && terms.block.contains(y)) {
+        return pearson_from_numerator(terms, x, y,
+                                      terms.block.numerator(x, y));
+    }
+    double numerator = centered_dot(row_x, terms.avg_score[x],
+                                    row_y, terms.avg_score[y]);
+    return pearson_from_numerator(terms, x, y, numerator);
+}
+
+/**
+ * comparator for the top-k items with highest score
  * (for min heap)
+ * a total order, higher score first and lower id first among equal
+ * scores, so the top-k does not depend on the order of the updates
  * @param a
  * @param b
- * @return compare result
+ * @return whether a ranks before b
  */
-bool heap_compare(const std::pair<size_t, double> &a,
-                  const std::pair<size_t, double> &b) {
-    return a.second > b.second;
+bool heap_compare(const std::pair<uint32_t, double> &a,
+                  const std::pair<uint32_t, double> &b) {
+    if (a.second != b.second) {
+        return a.second > b.second;
+    }
+    return a.first < b.first;
 }
 
 /**
@@ -306,12 +1022,12 @@ bool heap_compare(const std::pair<size_t, double> &a,
  * @param id new item id
  * @param score item's score
  */
-void update_top_k_score(std::vector<std::pair<size_t, double>> &top_k,
-                        size_t k, size_t id, double score) {
+void update_top_k_score(TopK &top_k,
+                        size_t k, uint32_t id, double score) {
     if (top_k.size() < k) {
         top_k.emplace_back(id, score);
         std::push_heap(top_k.begin(), top_k.end(), heap_compare);
-    } else if (top_k.front().second < score) {
+    } else if (heap_compare({id, score}, top_k.front())) {
         std::pop_heap(top_k.begin(), top_k.end(), heap_compare);
         top_k.back() = {id, score};
         std::push_heap(top_k.begin(), top_k.end(), heap_compare);
@@ -319,30 +1035,116 @@ void update_top_k_score(std::vector<std::pair<size_t, double>> &top_k,
 }
 
 /**
- * make similarity matrix
- * @param mat dataset
+ * sort a top-k heap into a similar users list
+ * @param heap top-k heap, left empty
+ * @param similar receives the heap, least similar first
+ */
+void take_top_k(TopK &heap, SimilarUsers &similar) {
+    std::sort_heap(heap.begin(), heap.end(), heap_compare);
+    std::reverse(heap.begin(), heap.end());
+
+    similar.ids.reserve(heap.size());
+    similar.scores.reserve(heap.size());
+    for (const auto &[id, score]: heap) {
+        similar.ids.emplace_back(id);
+        similar.scores.emplace_back(score);
+    }
+    heap.clear();
+}
+
+// most rows per side of a tile of the pair space,
+// bounds the top-k a tile keeps before merging
+constexpr size_t SIMILAR_TILE_ROWS = 256;
+
+/**
+ * size of the L2 cache of a core
+ * @return bytes, 1 MiB if unknown
+ */
+size_t l2_cache_size() {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (size > 0) {
+        return static_cast<size_t>(size);
+    }
+#endif
+    return 1 << 20;
+}
+
+/**
+ * bytes of a row
+ * @param size count of items of the row
+ * @return bytes of its columns and values
+ */
+size_t row_bytes(size_t size) {
+    return size * (sizeof(uint32_t) + sizeof(Rating));
+}
+
+/**
+ * make similarity matrix by scoring every pair of rows
+ * rows are cut into runs (tile sides) that fit in a quarter of the L2
+ * cache, and the upper triangle of the pair space into tiles of two
+ * sides, so a row is read from memory once per tile instead of once
+ * per pair, threads take the tiles in turn
+ * a tile whose rows do not fit in L2 anyway (very long rows) is cut into
+ * ranges of columns, the numerators are carried from range to range and
+ * still summed in column order
+ * a tile keeps the top-k of its own rows and merges them when done,
+ * heap_compare is a total order, so the result is the same as adding
+ * the pairs one by one
+ * a tile loads the rows of its sides once, so a compressed row is
+ * decoded once per tile, and only the rows of the tiles in progress are
+ * decoded at a time
+ * @param mat dataset (SparseMatrix or CompressedSparseMatrix)
+ * @param terms pearson terms
  * @param k k value
- * @param avg_score cached average score for each row
- * @return similarity matrix (represented by map)
+ * @param row_count size of the id space
+ * @return similarity matrix (indexed by row id)
  */
-std::map<size_t, std::vector<std::pair<size_t, double>>> get_top_k_similar_mat(
-        const SparseMatrix<double> &mat, size_t k,
-        const std::map<size_t, double> &avg_score) {
+template<typename Matrix>
+SimilarMat get_top_k_similar_mat_by_pairs(const Matrix &mat,
+                                          const PearsonTerms &terms,
+                                          size_t k, size_t row_count) {
+
+    std::vector<TopK> heaps(row_count);
 
-    std::map<size_t, std::vector<std::pair<size_t, double>>> result;
+    std::span<const uint32_t> row_ids = mat.row_indexes();
 
-    std::vector<size_t> row_ids =
-            {mat.row_indexes().begin(), mat.row_indexes().end()};
+    for (uint32_t i: row_ids) {
+        heaps[i].reserve(k);
+    }
 
-    for (size_t i: row_ids) {
-        std::vector<std::pair<size_t, double>> empty;
-        empty.reserve(k);
-        result[i] = empty;
+    // side a is row_ids[side_bounds[a], side_bounds[a + 1])
+    const size_t l2_size = l2_cache_size();
+    std::vector<size_t> side_bounds = {0};
+    std::vector<size_t> side_bytes = {0};
+    for (size_t i = 0; i < row_ids.size(); ++i) {
+        size_t bytes = row_bytes(mat.row_size(row_ids[i]));
+        size_t rows = i - side_bounds.back();
+        if (rows == SIMILAR_TILE_ROWS ||
+            (rows != 0 && side_bytes.back() + bytes > l2_size / 4)) {
+            side_bounds.emplace_back(i);
+            side_bytes.emplace_back(0);
+        }
+        side_bytes.back() += bytes;
+    }
+    side_bounds.emplace_back(row_ids.size());
+    size_t sides = side_bounds.size() - 1;
+
+    // tiles (a, b) with a <= b
+    std::vector<std::pair<size_t, size_t>> tiles;
+    tiles.reserve(sides * (sides + 1) / 2);
+    for (size_t a = 0; a < sides; ++a) {
+        for (size_t b = a; b < sides; ++b) {
+            tiles.emplace_back(a, b);
+        }
     }
+    // heaps of the rows of a tile side are merged under its lock
+    std::vector<std::mutex> side_locks(sides);
+    std::atomic<size_t> next_tile = 0;
 
     // info for progress bar
     const size_t all_count = row_ids.size() * (row_ids.size() - 1) / 2;
-    size_t current_count = 0;
+    std::atomic<size_t> current_count = 0;
     ProgressBar bar{
             option::PrefixText{"Train  "},
             option::BarWidth{50},
@@ -351,51 +1153,378 @@ std::map<size_t, std::vector<std::pair<size_t, double>>> get_top_k_similar_mat(
             option::ShowRemainingTime{true},
     };
 
-    for (size_t i = 0; i < row_ids.size(); ++i) {
-        for (size_t j = i + 1; j < row_ids.size(); ++j) {
-            size_t x = row_ids[i];
-            size_t y = row_ids[j];
-            auto &result_x = result[x];
-            auto &result_y = result[y];
-            double score = pearson(mat, x, y, avg_score);
-            update_top_k_score(result_x, k, y, score);
-            update_top_k_score(result_y, k, x, score);
+    size_t threads = std::clamp<size_t>(tiles.size(), 1, thread_count());
+    parallel_run(threads, [&](size_t thread) {
+        // top-k of the rows of both sides of a tile
+        std::vector<TopK> local(2 * SIMILAR_TILE_ROWS);
+        auto merge_side = [&](size_t side, size_t first) {
+            std::lock_guard lock(side_locks[side]);
+            for (size_t i = side_bounds[side]; i < side_bounds[side + 1];
+                 ++i) {
+                auto &top_k = local[first + i - side_bounds[side]];
+                for (const auto &[id, score]: top_k) {
+                    update_top_k_score(heaps[row_ids[i]], k, id, score);
+                }
+                top_k.clear();
+            }
+        };
+        // numerators of the pairs of a tile cut into column ranges,
+        // and where every row of the tile is cut
+        std::vector<double> numerators;
+        std::vector<size_t> cuts;
+        // rows of both sides of a tile
+        RowRun run_a;
+        RowRun run_b;
+
+        for (size_t tile; (tile = next_tile++) < tiles.size();) {
+            auto [a, b] = tiles[tile];
+            size_t a_begin = side_bounds[a];
+            size_t a_end = side_bounds[a + 1];
+            size_t b_begin = side_bounds[b];
+            size_t b_end = side_bounds[b + 1];
+            size_t b_rows = b_end - b_begin;
+            auto add_pair = [&](size_t i, size_t j, double score) {
+                update_top_k_score(local[i - a_begin], k, row_ids[j], score);
+                update_top_k_score(local[SIMILAR_TILE_ROWS + j - b_begin],
+                                   k, row_ids[i], score);
+            };
+            load_rows(mat, row_ids.subspan(a_begin, a_end - a_begin), run_a);
+            if (a != b) {
+                load_rows(mat, row_ids.subspan(b_begin, b_rows), run_b);
+            }
+            // side b follows side a, unless they are the same
+            auto row_of = [&](size_t i) {
+                return i < a_end ? run_a.rows[i - a_begin] :
+                       run_b.rows[i - b_begin];
+            };
+
+            size_t tile_bytes = side_bytes[a] + (a == b ? 0 : side_bytes[b]);
+            size_t ranges = (tile_bytes + l2_size / 2 - 1) / (l2_size / 2);
+            if (ranges <= 1) {
+                for (size_t i = a_begin; i < a_end; ++i) {
+                    for (size_t j = std::max(b_begin, i + 1); j < b_end;
+                         ++j) {
+                        add_pair(i, j, pearson(terms, row_ids[i], row_of(i),
+                                               row_ids[j], row_of(j)));
+                    }
+                }
+            } else {
+                // cut the columns [0, col_end) of the tile evenly
+                uint32_t col_end = 0;
+                for (auto [begin, end]: {std::pair(a_begin, a_end),
+                                         std::pair(b_begin, b_end)}) {
+                    for (size_t i = begin; i < end; ++i) {
+                        col_end = std::max(col_end,
+                                           row_of(i).cols.back() + 1);
+                    }
+                }
+                cuts.clear();
+                auto cut_rows = [&](size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; ++i) {
+                        RatingRow row = row_of(i);
+                        for (size_t r = 0; r <= ranges; ++r) {
+                            uint32_t col = static_cast<uint32_t>(
+                                    uint64_t{col_end} * r / ranges);
+                            cuts.emplace_back(std::lower_bound(
+                                    row.cols.begin(), row.cols.end(), col) -
+                                              row.cols.begin());
+                        }
+                    }
+                };
+                cut_rows(a_begin, a_end);
+                if (a != b) {
+                    cut_rows(b_begin, b_end);
+                }
+                // pairs of the dense block are not cut
+                auto in_block = [&](size_t i, size_t j) {
+                    return terms.block.contains(row_ids[i]) &&
+                           terms.block.contains(row_ids[j]);
+                };
+                // side b follows side a in cuts, unless they are the same
+                auto cut_of = [&](size_t i, size_t r) {
+                    size_t first = i < a_end ? i - a_begin :
+                                   a_end - a_begin + i - b_begin;
+                    return cuts[first * (ranges + 1) + r];
+                };
+
+                numerators.assign((a_end - a_begin) * b_rows, 0);
+                for (size_t r = 0; r < ranges; ++r) {
+                    for (size_t i = a_begin; i < a_end; ++i) {
+                        RatingRow row_x = row_of(i);
+                        double avg_x = terms.avg_score[row_ids[i]];
+                        size_t x_begin = cut_of(i, r);
+                        size_t x_end = cut_of(i, r + 1);
+                        RatingRow range_x = {
+                                row_x.cols.subspan(x_begin, x_end - x_begin),
+                                row_x.vals.subspan(x_begin, x_end - x_begin)};
+                        for (size_t j = std::max(b_begin, i + 1); j < b_end;
+                             ++j) {
+                            if (in_block(i, j)) {
+                                continue;
+                            }
+                            RatingRow row_y = row_of(j);
+                            size_t y_begin = cut_of(j, r);
+                            size_t y_end = cut_of(j, r + 1);
+                            RatingRow range_y = {
+                                    row_y.cols.subspan(y_begin,
+                                                       y_end - y_begin),
+                                    row_y.vals.subspan(y_begin,
+                                                       y_end - y_begin)};
+                            double &numerator = numerators[
+                                    (i - a_begin) * b_rows + j - b_begin];
+                            numerator = centered_dot(
+                                    range_x, avg_x, range_y,
+                                    terms.avg_score[row_ids[j]],
+                                    numerator);
+                        }
+                    }
+                }
+                for (size_t i = a_begin; i < a_end; ++i) {
+                    for (size_t j = std::max(b_begin, i + 1); j < b_end;
+                         ++j) {
+                        double numerator = in_block(i, j) ?
+                                terms.block.numerator(row_ids[i],
+                                                      row_ids[j]) :
+                                numerators[(i - a_begin) * b_rows +
+                                           j - b_begin];
+                        add_pair(i, j, pearson_from_numerator(
+                                terms, row_ids[i], row_ids[j], numerator));
+                    }
+                }
+            }
+            merge_side(a, 0);
+            merge_side(b, SIMILAR_TILE_ROWS);
 
             // show progress bar
-            double progress = static_cast<double>(++current_count) / all_count;
-            if (current_count == all_count || current_count % 1000000 == 0) {
-                bar.set_progress(progress * 100);
+            size_t pairs = a == b ?
+                           (a_end - a_begin) * (a_end - a_begin - 1) / 2 :
+                           (a_end - a_begin) * b_rows;
+            size_t count = current_count += pairs;
+            if (thread == 0 && count != all_count) {
+                bar.set_progress(static_cast<double>(count) / all_count * 100);
             }
         }
+    });
+    bar.set_progress(100);
+
+    SimilarMat result(row_count);
+    for (uint32_t i: row_ids) {
+        take_top_k(heaps[i], result[i]);
+        heaps[i] = {};
     }
 
-    for (size_t i: row_ids) {
-        auto &heap = result[i];
-        std::sort_heap(heap.begin(), heap.end(), heap_compare);
-        std::reverse(heap.begin(), heap.end());
+    return result;
+}
+
+// rows a thread takes at a time from the shared queue
+constexpr size_t SIMILAR_BATCH = 16;
+
+/**
+ * drop the rows of the dense block from its columns
+ * @param postings transposed rows
+ * @param block dense block
+ * @return the block columns without the block rows, other columns empty
+ */
+SparseMatrix<Rating> postings_outside_block(
+        const SparseMatrix<Rating> &postings, const DenseBlock &block) {
+    std::vector<size_t> offsets = {0};
+    std::vector<uint32_t> cols;
+    std::vector<Rating> vals;
+    for (size_t col = 0; col < block.cols.size(); ++col) {
+        if (block.cols[col]) {
+            for (const auto &other: postings.get_row(col)) {
+                if (!block.contains(other.col)) {
+                    cols.emplace_back(other.col);
+                    vals.emplace_back(other.val);
+                }
+            }
+        }
+        offsets.emplace_back(cols.size());
     }
+    return SparseMatrix<Rating>::from_csr(
+            std::move(offsets), std::move(cols), std::move(vals));
+}
+
+/**
+ * make similarity matrix from the columns of the rows
+ * a row is only scored against the rows sharing a column with it,
+ * found through the transposed rows, the numerators are summed column by
+ * column in the same order as pearson(), so the scores are the same
+ * a row of the dense block skips the other block rows in the block
+ * columns and adds their gram matrix entries last, like pearson()
+ * rows sharing no column score exactly 0 and only the lowest ids of them
+ * can enter a top-k, so they are added without scoring
+ * a compressed row is decoded a block at a time, only the transposed rows
+ * are plain
+ * @param mat dataset (SparseMatrix or CompressedSparseMatrix)
+ * @param terms pearson terms
+ * @param k k value
+ * @param row_count size of the id space
+ * @return similarity matrix (indexed by row id)
+ */
+template<typename Matrix>
+SimilarMat get_top_k_similar_mat_by_index(const Matrix &mat,
+                                          const PearsonTerms &terms,
+                                          size_t k, size_t row_count) {
+
+    std::span<const uint32_t> row_ids = mat.row_indexes();
+    SparseMatrix<Rating> postings = mat.transpose();
+    const auto &avg_score = terms.avg_score;
+    const auto &sum_squares = terms.sum_squares;
+    const DenseBlock &block = terms.block;
+    SparseMatrix<Rating> outside_postings =
+            postings_outside_block(postings, block);
+
+    SimilarMat result(row_count);
+    std::atomic<size_t> next_row = 0;
+
+    // info for progress bar
+    const size_t all_count = row_ids.size();
+    std::atomic<size_t> current_count = 0;
+    ProgressBar bar{
+            option::PrefixText{"Train  "},
+            option::BarWidth{50},
+            option::ShowPercentage{true},
+            option::ShowElapsedTime{true},
+            option::ShowRemainingTime{true},
+    };
+
+    size_t threads = std::clamp<size_t>(row_ids.size() / SIMILAR_BATCH,
+                                        1, thread_count());
+    parallel_run(threads, [&](size_t thread) {
+        // numerators of the rows sharing a column with the current row
+        std::vector<double> numerators(row_count, 0);
+        std::vector<bool> shared(row_count, false);
+        std::vector<uint32_t> shared_rows;
+        TopK heap;
+        heap.reserve(k);
+
+        for (size_t begin; (begin = next_row.fetch_add(SIMILAR_BATCH)) <
+                           row_ids.size();) {
+            size_t end = std::min(begin + SIMILAR_BATCH, row_ids.size());
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t x = row_ids[i];
+                bool x_in_block = block.contains(x);
+                for_each_block(mat, x, [&](RatingRow row) {
+                    for (const auto &item: row) {
+                        double val = item.val - avg_score[x];
+                        const SparseMatrix<Rating> &source =
+                                x_in_block && block.cols[item.col] ?
+                                outside_postings : postings;
+                        for (const auto &other: source.get_row(item.col)) {
+                            uint32_t y = other.col;
+                            if (y == x) {
+                                continue;
+                            }
+                            if (!shared[y]) {
+                                shared[y] = true;
+                                shared_rows.emplace_back(y);
+                            }
+                            numerators[y] += val * (other.val - avg_score[y]);
+                        }
+                    }
+                });
+                if (x_in_block) {
+                    size_t slot = block.slots[x];
+                    for (size_t other = 0; other < block.rows.size();
+                         ++other) {
+                        uint32_t y = block.rows[other];
+                        if (y == x) {
+                            continue;
+                        }
+                        if (!shared[y]) {
+                            shared[y] = true;
+                            shared_rows.emplace_back(y);
+                        }
+                        numerators[y] +=
+                                block.gram[slot * block.rows.size() + other];
+                    }
+                }
+
+                for (uint32_t y: shared_rows) {
+                    double denominator =
+                            std::sqrt(sum_squares[x] * sum_squares[y]);
+                    double score = std::abs(denominator) <
+                                   std::numeric_limits<double>::epsilon() ?
+                                   0 : numerators[y] / denominator;
+                    update_top_k_score(heap, k, y, score);
+                    numerators[y] = 0;
+                }
+
+                // the other rows score 0, lower ids rank first
+                for (uint32_t y: row_ids) {
+                    if (y == x || shared[y]) {
+                        continue;
+                    }
+                    if (heap.size() == k &&
+                        !heap_compare({y, 0.0}, heap.front())) {
+                        break;
+                    }
+                    update_top_k_score(heap, k, y, 0);
+                }
+
+                for (uint32_t y: shared_rows) {
+                    shared[y] = false;
+                }
+                shared_rows.clear();
+                take_top_k(heap, result[x]);
+            }
+
+            // show progress bar
+            size_t count = current_count += end - begin;
+            if (thread == 0 && count != all_count) {
+                bar.set_progress(static_cast<double>(count) / all_count * 100);
+            }
+        }
+    });
+    bar.set_progress(100);
 
     return result;
 }
 
+/**
+ * make similarity matrix
+ * @param mat dataset (SparseMatrix or CompressedSparseMatrix),
+ *            a compressed one is never decoded as a whole
+ * @param k k value
+ * @param avg_score cached average score for each row
+ * @param row_count size of the id space
+ * @param flags FEAT_PAIRWISE scores every pair of rows,
+ *              FEAT_DENSE_BLOCK multiplies the dense block as a whole
+ * @return similarity matrix (indexed by row id)
+ */
+template<typename Matrix>
+SimilarMat get_top_k_similar_mat(
+        const Matrix &mat, size_t k,
+        const std::vector<double> &avg_score,
+        size_t row_count,
+        int flags) {
+    PearsonTerms terms = get_pearson_terms(mat, avg_score, row_count);
+    if (flags & FEAT_DENSE_BLOCK) {
+        terms.block = make_dense_block(mat, terms, row_count);
+    }
+    if (flags & FEAT_PAIRWISE) {
+        return get_top_k_similar_mat_by_pairs(mat, terms, k, row_count);
+    }
+    return get_top_k_similar_mat_by_index(mat, terms, k, row_count);
+}
+
 /**
  * get similar items of a given item
  * @param item_id item id to find similar items
- * @param item_attr item attribute matrix (item -> attribute)
- * @param item_attr_rev reverse item attribute matrix (attribute -> item)
+ * @param item_attr item attribute matrix (item <-> attribute)
  * @return similar items split by attribute
  */
-std::array<std::span<const IntItem>, 2> get_similar_items(
+std::array<IntRow, 2> get_similar_items(
         size_t item_id,
-        const SparseMatrix<int> &item_attr,
-        const SparseMatrix<int> &item_attr_rev
+        const DualSparseMatrix<int> &item_attr
 ) {
-    std::array<std::span<const IntItem>, 2> result;
-    std::span<const IntItem> attrs = item_attr.get_row(item_id);
+    std::array<IntRow, 2> result;
+    IntRow attrs = item_attr.get_row(item_id);
     for (size_t i = 0; i < attrs.size(); ++i) {
         // find which item has the same attribute id
-        const size_t &attr_id = attrs[i].col;
-        std::span<const IntItem> entries = item_attr_rev.get_row(attr_id);
+        const uint32_t &attr_id = attrs.cols[i];
+        IntRow entries = item_attr.get_col(attr_id);
         result[i] = entries;
     }
     return result;
@@ -405,27 +1534,27 @@ std::array<std::span<const IntItem>, 2> get_similar_items(
  * predict score of a given item
  * @param user_id user id to predict_impl
  * @param item_id item id to predict_impl
- * @param user_mat user matrix (user -> item score)
+ * @param user_mat user matrix (user -> item score),
+ *                 SparseMatrix or CompressedSparseMatrix
  * @param global_avg_score cached global average score
  * @param user_avg_score cached average score for each user
  * @param item_avg_score cached average score for each item
  * @param similar_score_map cached similar score map
- * @param item_attr item attribute matrix (item -> attribute)
- * @param item_attr_rev reverse item attribute matrix (attribute -> item)
+ * @param item_attr item attribute matrix (item <-> attribute)
  * @param consider_similar_items whether it is the first try,
  *                  determine whether to calculate similar items
  * @return predicted score
  */
+template<typename Matrix>
 double predict_impl(
         size_t user_id,
         size_t item_id,
-        const SparseMatrix<double> &user_mat,
+        const Matrix &user_mat,
         double global_avg_score,
-        std::map<size_t, double> &user_avg_score,
-        std::map<size_t, double> &item_avg_score,
-        std::map<size_t, std::vector<std::pair<size_t, double>>> &similar_score_map,
-        const SparseMatrix<int> &item_attr,
-        const SparseMatrix<int> &item_attr_rev,
+        const std::vector<double> &user_avg_score,
+        const std::vector<double> &item_avg_score,
+        const SimilarMat &similar_score_map,
+        const DualSparseMatrix<int> &item_attr,
         bool consider_similar_items,
         int flags) {
     double bias_user = user_avg_score[user_id] - global_avg_score;
@@ -435,14 +1564,16 @@ double predict_impl(
     double numerator = 0;
     double denominator = 0;
     size_t count = 0;
-    for (const auto &[similar_user, similarity]:
-            similar_score_map[user_id]) {
 
-        // if the similar user has rated the item
-        double similar_user_score = user_mat.get(similar_user, item_id);
-        if (similar_user_score < 0) {
-            continue;
-        }
+    // similar users who have rated the item, the buffer is reused
+    // across calls, it is used up before the recursive calls below
+    const SimilarUsers &similar_users = similar_score_map[user_id];
+    thread_local std::vector<std::pair<uint32_t, Rating>> rated;
+    user_mat.gather(similar_users.ids, item_id, rated);
+
+    for (const auto &[index, similar_user_score]: rated) {
+        uint32_t similar_user = similar_users.ids[index];
+        double similarity = similar_users.scores[index];
         count++;
 
         double bias_similar_user =
@@ -479,8 +1610,7 @@ double predict_impl(
 
         double similar_item_score_nominator = 0;
         double similar_item_score_denominator = 0;
-        for (std::span<const IntItem> items: get_similar_items(
-                item_id, item_attr, item_attr_rev)) {
+        for (IntRow items: get_similar_items(item_id, item_attr)) {
 
             // except the item itself
             size_t similar_item_count = items.size() - 1;
@@ -493,8 +1623,7 @@ double predict_impl(
                                  1.0 / similar_item_count :
                                  1.0;
 
-            for (const IntItem &entry: items) {
-                const size_t &similar_item_id = entry.col;
+            for (uint32_t similar_item_id: items.cols) {
 
                 // skip the item itself
                 if (similar_item_id == item_id) {
@@ -503,12 +1632,12 @@ double predict_impl(
 
                 // first try: get similar item score from user matrix directly
                 //            which is faster and more accurate
-                double similar_item_score = user_mat.get(
-                        user_id, similar_item_id);
-
-                // second try: try to predict similar item score
-                //             by recursively calling predict()
-                if (similar_item_score < 0) {
+                double similar_item_score;
+                if (auto rated = user_mat.get(user_id, similar_item_id)) {
+                    similar_item_score = *rated;
+                } else {
+                    // second try: try to predict similar item score
+                    //             by recursively calling predict()
                     similar_item_score = predict_impl(
                             user_id,
                             similar_item_id,
@@ -518,7 +1647,6 @@ double predict_impl(
                             item_avg_score,
                             similar_score_map,
                             item_attr,
-                            item_attr_rev,
                             false,
                             flags
                     );
@@ -556,27 +1684,40 @@ double predict_impl(
 
 /**
  * solve the problem
- * @param user_mat train dataset
+ * @param user_mat train dataset (SparseMatrix or CompressedSparseMatrix)
+ * @param stats rating sums and counts of user_mat, gives the averages
+ *              without scanning it
  * @param test_user_mat test dataset
- * @param item_attr item attribute matrix (item -> attribute)
+ * @param item_attr item attribute matrix (item <-> attribute)
+ * @param dict id dictionary, gives the size of the user and item id spaces
  * @return predicted score matrix
  */
-SparseMatrix<double> predict(const SparseMatrix<double> &user_mat,
-                             const SparseMatrix<double> &test_user_mat,
-                             const SparseMatrix<int> &item_attr,
-                             int k,
-                             int flags) {
-
-    SparseMatrix<double> item_mat = user_mat.transpose();
-
-    double global_avg_score = get_global_avg_score(user_mat);
-    std::map<size_t, double> user_avg_score = get_avg_score_by_row(user_mat);
-    std::map<size_t, double> item_avg_score = get_avg_score_by_row(item_mat);
+template<typename Matrix>
+SparseMatrix<double> predict_all(const Matrix &user_mat,
+                                 const RatingStats &stats,
+                                 const SparseMatrix<Rating> &test_user_mat,
+                                 const DualSparseMatrix<int> &item_attr,
+                                 const IdDictionary &dict,
+                                 int k,
+                                 int flags) {
+    if (stats.user_counts.size() > dict.users.size() ||
+        stats.item_counts.size() > dict.items.size()) {
+        throw std::runtime_error("Rating stats do not match the dataset");
+    }
 
-    SparseMatrix<int> item_attr_rev = item_attr.transpose();
+    // ids added after the stats were taken have no ratings and get 0
+    double global_avg_score = stats.global_avg();
+    std::vector<double> user_avg_score(dict.users.size(), 0);
+    for (size_t user = 0; user < stats.user_counts.size(); ++user) {
+        user_avg_score[user] = stats.user_avg(user);
+    }
+    std::vector<double> item_avg_score(dict.items.size(), 0);
+    for (size_t item = 0; item < stats.item_counts.size(); ++item) {
+        item_avg_score[item] = stats.item_avg(item);
+    }
 
-    auto similar_score_map =
-            get_top_k_similar_mat(user_mat, k, user_avg_score);
+    auto similar_score_map = get_top_k_similar_mat(
+            user_mat, k, user_avg_score, dict.users.size(), flags);
 
     // info for progress bar
     const size_t all_count = test_user_mat.get_all().size();
@@ -589,11 +1730,12 @@ SparseMatrix<double> predict(const SparseMatrix<double> &user_mat,
             option::ShowRemainingTime{true},
     };
 
-    std::vector<FpItem> result;
+    // one prediction per test entry, in the same place
+    RatingRow test_all = test_user_mat.get_all();
+    std::vector<double> result(test_all.size());
 
     for (size_t test_user_id: test_user_mat.row_indexes()) {
-        for (const FpItem &item: test_user_mat.get_row(test_user_id)) {
-            const size_t &item_id = item.col;
+        for (uint32_t item_id: test_user_mat.get_row(test_user_id).cols) {
 
             double score = predict_impl(
                     test_user_id,
@@ -604,12 +1746,11 @@ SparseMatrix<double> predict(const SparseMatrix<double> &user_mat,
                     item_avg_score,
                     similar_score_map,
                     item_attr,
-                    item_attr_rev,
                     true,
                     flags
             );
 
-            result.emplace_back(test_user_id, item_id, score);
+            result[current_count] = score;
 
             // show progress bar
             double progress = static_cast<double>(++current_count) / all_count;
@@ -618,7 +1759,33 @@ SparseMatrix<double> predict(const SparseMatrix<double> &user_mat,
             }
         }
     }
-    return SparseMatrix<double>(result);
+    auto offsets = test_user_mat.offsets();
+    return SparseMatrix<double>::from_csr(
+            std::vector<size_t>(offsets.begin(), offsets.end()),
+            std::vector<uint32_t>(test_all.cols.begin(), test_all.cols.end()),
+            std::move(result));
+}
+
+SparseMatrix<double> predict(const SparseMatrix<Rating> &user_mat,
+                             const RatingStats &stats,
+                             const SparseMatrix<Rating> &test_user_mat,
+                             const DualSparseMatrix<int> &item_attr,
+                             const IdDictionary &dict,
+                             int k,
+                             int flags) {
+    return predict_all(user_mat, stats, test_user_mat, item_attr, dict, k,
+                       flags);
+}
+
+SparseMatrix<double> predict(const CompressedSparseMatrix<Rating> &user_mat,
+                             const RatingStats &stats,
+                             const SparseMatrix<Rating> &test_user_mat,
+                             const DualSparseMatrix<int> &item_attr,
+                             const IdDictionary &dict,
+                             int k,
+                             int flags) {
+    return predict_all(user_mat, stats, test_user_mat, item_attr, dict, k,
+                       flags);
 }
 
 /**
@@ -628,26 +1795,33 @@ SparseMatrix<double> predict(const SparseMatrix<double> &user_mat,
  * @return RMSE
  */
 double RMSE(const SparseMatrix<double> &mat1,
-            const SparseMatrix<double> &mat2) {
+            const SparseMatrix<Rating> &mat2) {
 
-    std::span<const FpItem> mat1_rows = mat1.get_all();
-    std::span<const FpItem> mat2_rows = mat2.get_all();
+    FpRow mat1_items = mat1.get_all();
+    RatingRow mat2_items = mat2.get_all();
 
-    if (mat1_rows.size() != mat2_rows.size()) {
+    if (mat1_items.size() != mat2_items.size()) {
         throw std::runtime_error("RMSE size not equal");
     }
 
+    // same rows with the same length, so items line up in row-major order
+    if (!std::ranges::equal(mat1.row_indexes(), mat2.row_indexes())) {
+        throw std::runtime_error("RMSE row or col not equal");
+    }
+    for (size_t row_id: mat1.row_indexes()) {
+        if (mat1.get_row(row_id).size() != mat2.get_row(row_id).size()) {
+            throw std::runtime_error("RMSE row or col not equal");
+        }
+    }
+
     double sum = 0;
-    size_t count = mat1_rows.size();
+    size_t count = mat1_items.size();
 
     for (size_t i = 0; i < count; ++i) {
-        const FpItem &predict_item = mat1_rows[i];
-        const FpItem &real_item = mat2_rows[i];
-        if (predict_item.row != real_item.row ||
-            predict_item.col != real_item.col) {
+        if (mat1_items.cols[i] != mat2_items.cols[i]) {
             throw std::runtime_error("RMSE row or col not equal");
         }
-        sum += square(predict_item.val - real_item.val);
+        sum += square(mat1_items.vals[i] - mat2_items.vals[i]);
     }
 
     return std::sqrt(sum / count);
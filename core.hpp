@@ -1,35 +1,186 @@
 #ifndef RECOMMENDER_SYSTEM_CORE_HPP
 #define RECOMMENDER_SYSTEM_CORE_HPP
 
+#include <cstdint>
 #include <string>
+#include <utility>
+#include <vector>
 #include "sparse_matrix.hpp"
+#include "compressed_matrix.hpp"
+#include "dual_matrix.hpp"
+#include "id_map.hpp"
 
 constexpr int FEAT_USE_ATTR = 1;
 constexpr int FEAT_USE_WEIGHT = 2;
+constexpr int FEAT_PAIRWISE = 4;
+constexpr int FEAT_DENSE_BLOCK = 8;
 
-SparseMatrix<double> read_train_dataset(const std::string &filename);
+// ratings are integers in [0, MAX_RATING], stored in 8 bits
+// and widened to double inside the kernels
+using Rating = uint8_t;
+constexpr int MAX_RATING = 100;
 
-SparseMatrix<double> read_test_dataset(const std::string &filename);
+/**
+ * queries of a test file in file order
+ */
+struct QueryOrder {
+    // index in the test matrix entries (get_all()) of every query line
+    std::vector<size_t> entries;
+    // runs of lines of the same user: (internal user id, first line)
+    std::vector<std::pair<uint32_t, size_t>> blocks;
+};
 
-SparseMatrix<int> read_item_attribute(const std::string &filename);
+/**
+ * rating sums and counts of every user and item
+ * ratings are integers, so the sums are exact and can be updated
+ * entry by entry, the averages are the same as scanning the matrix
+ */
+struct RatingStats {
+    std::vector<uint64_t> user_sums;
+    std::vector<uint64_t> user_counts;
+    std::vector<uint64_t> item_sums;
+    std::vector<uint64_t> item_counts;
+
+    /**
+     * grow to the size of the id spaces, new ids have no ratings
+     * @param user_count
+     * @param item_count
+     */
+    void resize(size_t user_count, size_t item_count) {
+        user_sums.resize(user_count, 0);
+        user_counts.resize(user_count, 0);
+        item_sums.resize(item_count, 0);
+        item_counts.resize(item_count, 0);
+    }
+
+    /**
+     * get average score of all ratings
+     * @return average score
+     */
+    double global_avg() const {
+        uint64_t sum = 0;
+        uint64_t count = 0;
+        for (size_t user = 0; user < user_counts.size(); ++user) {
+            sum += user_sums[user];
+            count += user_counts[user];
+        }
+        return static_cast<double>(sum) / static_cast<double>(count);
+    }
+
+    /**
+     * get average score of a user
+     * @param user
+     * @return average score, 0 if the user has no ratings
+     */
+    double user_avg(size_t user) const {
+        return user_counts[user] == 0 ? 0 :
+               static_cast<double>(user_sums[user]) / user_counts[user];
+    }
+
+    /**
+     * get average score of an item
+     * @param item
+     * @return average score, 0 if the item has no ratings
+     */
+    double item_avg(size_t item) const {
+        return item_counts[item] == 0 ? 0 :
+               static_cast<double>(item_sums[item]) / item_counts[item];
+    }
+};
+
+/**
+ * a chunk of a dataset file, with chunk-local ids
+ */
+struct DatasetChunk {
+    IdMap users;
+    IdMap items;
+    // runs of entries of the same user: (local user id, first entry)
+    std::vector<std::pair<uint32_t, size_t>> runs;
+    // entries of the chunk are [begin, end) of the dataset arrays
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+/**
+ * a dataset file parsed without a dictionary, so files can be parsed
+ * concurrently and added to the dictionary later in a fixed order
+ * entries are in file order, with chunk-local ids
+ */
+struct ParsedDataset {
+    std::vector<DatasetChunk> chunks;
+    std::vector<uint32_t> cols;
+    std::vector<Rating> vals;
+};
+
+/**
+ * an item attribute file parsed without a dictionary
+ */
+struct ParsedAttributes {
+    IdMap items;
+    // (file-local item id, attribute) in file order
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;
+};
+
+ParsedDataset parse_train_dataset(const std::string &filename);
+
+ParsedDataset parse_test_dataset(const std::string &filename);
+
+SparseMatrix<Rating> intern_dataset(ParsedDataset data, IdDictionary &dict,
+                                    DuplicatePolicy policy,
+                                    QueryOrder *order = nullptr);
+
+ParsedAttributes parse_item_attribute_file(const std::string &filename);
+
+DualSparseMatrix<int> intern_item_attribute(ParsedAttributes parsed,
+                                            IdDictionary &dict);
+
+SparseMatrix<Rating> read_train_dataset(const std::string &filename,
+                                        IdDictionary &dict);
+
+SparseMatrix<Rating> read_test_dataset(const std::string &filename,
+                                       IdDictionary &dict,
+                                       QueryOrder *order = nullptr);
+
+DualSparseMatrix<int> read_item_attribute(const std::string &filename,
+                                      IdDictionary &dict);
+
+RatingStats get_rating_stats(const SparseMatrix<Rating> &mat,
+                             const IdDictionary &dict);
+
+SparseMatrix<Rating> merge_delta(const SparseMatrix<Rating> &mat,
+                                 const SparseMatrix<Rating> &delta,
+                                 const IdDictionary &dict,
+                                 RatingStats &stats);
 
 void write_dataset(const std::string &filename,
-                   const SparseMatrix<double> &mat);
+                   const SparseMatrix<double> &mat,
+                   const IdDictionary &dict);
 
-void write_dataset_in_order(const std::string &reference,
+void write_dataset_in_order(const QueryOrder &order,
                             const std::string &filename,
-                            const SparseMatrix<double> &mat);
+                            const SparseMatrix<double> &mat,
+                            const IdDictionary &dict);
+
+std::pair<SparseMatrix<Rating>, SparseMatrix<Rating>> make_train_test(
+        const SparseMatrix<Rating> &mat, size_t test_count);
 
-std::pair<SparseMatrix<double>, SparseMatrix<double>> make_train_test(
-        const SparseMatrix<double> &mat, size_t test_count);
+SparseMatrix<double> predict(const SparseMatrix<Rating> &user_mat,
+                             const RatingStats &stats,
+                             const SparseMatrix<Rating> &test_user_mat,
+                             const DualSparseMatrix<int> &item_attr,
+                             const IdDictionary &dict,
+                             int k,
+                             int flags);
 
-SparseMatrix<double> predict(const SparseMatrix<double> &user_mat,
-                             const SparseMatrix<double> &test_user_mat,
-                             const SparseMatrix<int> &item_attr,
+SparseMatrix<double> predict(const CompressedSparseMatrix<Rating> &user_mat,
+                             const RatingStats &stats,
+                             const SparseMatrix<Rating> &test_user_mat,
+                             const DualSparseMatrix<int> &item_attr,
+                             const IdDictionary &dict,
                              int k,
                              int flags);
 
 double RMSE(const SparseMatrix<double> &mat1,
-            const SparseMatrix<double> &mat2);
+            const SparseMatrix<Rating> &mat2);
 
 #endif //RECOMMENDER_SYSTEM_CORE_HPP
@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include "decompress.hpp"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// decompressed bytes produced before they are pushed to the ring
+static constexpr size_t DECODE_BLOCK = 1 << 18;
+
+/**
+ * source of decompressed bytes
+ */
+class Decoder {
+public:
+    virtual ~Decoder() = default;
+
+    /**
+     * decompress the next bytes
+     * @param out
+     * @param size
+     * @return count of bytes, 0 at the end of the file
+     */
+    virtual size_t decode(char *out, size_t size) = 0;
+};
+
+#ifdef HAVE_ZLIB
+
+/**
+ * gzip decoder, concatenated members are read as one stream
+ */
+class GzipDecoder : public Decoder {
+public:
+    explicit GzipDecoder(const std::string &filename)
+            : filename(filename), file(gzopen(filename.c_str(), "rb")) {
+        if (file == nullptr) {
+            throw std::runtime_error("Cannot open file " + filename);
+        }
+        gzbuffer(file, DECODE_BLOCK);
+    }
+
+    ~GzipDecoder() override {
+        gzclose(file);
+    }
+
+    size_t decode(char *out, size_t size) override {
+        int count = gzread(file, out, static_cast<unsigned>(size));
+        int code = Z_OK;
+        const char *message = gzerror(file, &code);
+        // a truncated file only shows up as Z_BUF_ERROR at the end
+        if (count < 0 || (count == 0 && code != Z_OK)) {
+            // zlib puts the file name in front of its messages
+            throw std::runtime_error(std::string("Cannot decompress ") +
+                                     message);
+        }
+        return static_cast<size_t>(count);
+    }
+
+private:
+    std::string filename;
+    gzFile file;
+};
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+/**
+ * zstd decoder, concatenated frames are read as one stream
+ */
+class ZstdDecoder : public Decoder {
+public:
+    explicit ZstdDecoder(const std::string &filename)
+            : filename(filename), file(std::fopen(filename.c_str(), "rb")),
+              stream(ZSTD_createDStream()), input(ZSTD_DStreamInSize()) {
+        if (file == nullptr) {
+            ZSTD_freeDStream(stream);
+            throw std::runtime_error("Cannot open file " + filename);
+        }
+        ZSTD_initDStream(stream);
+    }
+
+    ~ZstdDecoder() override {
+        ZSTD_freeDStream(stream);
+        std::fclose(file);
+    }
+
+    size_t decode(char *out, size_t size) override {
+        ZSTD_outBuffer output{out, size, 0};
+        while (output.pos == 0) {
+            bool at_end = false;
+            if (in.pos == in.size) {
+                in.size = std::fread(input.data(), 1, input.size(), file);
+                in.pos = 0;
+                if (std::ferror(file)) {
+                    throw std::runtime_error("Cannot read file " + filename);
+                }
+                if (in.size == 0 && last_result == 0) {
+                    return 0;
+                }
+                at_end = in.size == 0;
+            }
+            // at the end this only flushes what a full output held back
+            last_result = ZSTD_decompressStream(stream, &output, &in);
+            if (ZSTD_isError(last_result)) {
+                throw std::runtime_error(
+                        "Cannot decompress " + filename + ": " +
+                        ZSTD_getErrorName(last_result));
+            }
+            if (at_end && output.pos == 0) {
+                throw std::runtime_error(
+                        "Cannot decompress " + filename + ": truncated file");
+            }
+        }
+        return output.pos;
+    }
+
+private:
+    std::string filename;
+    std::FILE *file;
+    ZSTD_DStream *stream;
+    std::vector<char> input;
+    ZSTD_inBuffer in{input.data(), 0, 0};
+    size_t last_result = 0;
+};
+
+#endif
+
+static bool ends_with(const std::string &str, const std::string &suffix) {
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(),
+                       suffix) == 0;
+}
+
+/**
+ * open a decoder for a file by its extension
+ * @param filename
+ * @return decoder
+ */
+static std::unique_ptr<Decoder> open_decoder(const std::string &filename) {
+    if (ends_with(filename, ".gz")) {
+#ifdef HAVE_ZLIB
+        return std::make_unique<GzipDecoder>(filename);
+#else
+        throw std::runtime_error("Built without gzip support: " + filename);
+#endif
+    }
+    if (ends_with(filename, ".zst")) {
+#ifdef HAVE_ZSTD
+        return std::make_unique<ZstdDecoder>(filename);
+#else
+        throw std::runtime_error("Built without zstd support: " + filename);
+#endif
+    }
+    throw std::runtime_error("Unknown compression: " + filename);
+}
+
+bool DecompressStream::is_compressed(const std::string &filename) {
+    return ends_with(filename, ".gz") || ends_with(filename, ".zst");
+}
+
+DecompressStream::DecompressStream(const std::string &filename,
+                                   size_t capacity)
+        : ring(std::max<size_t>(capacity, DECODE_BLOCK)) {
+    // open in the caller, so a missing file is reported right away
+    auto decoder = open_decoder(filename);
+    worker = std::thread([this, decoder = std::move(decoder)]() mutable {
+        try {
+            std::vector<char> block(DECODE_BLOCK);
+            while (size_t count = decoder->decode(block.data(),
+                                                  block.size())) {
+                if (!push(block.data(), count)) {
+                    break;
+                }
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex);
+            error = std::current_exception();
+        }
+        std::lock_guard lock(mutex);
+        finished = true;
+        not_empty.notify_all();
+    });
+}
+
+DecompressStream::~DecompressStream() {
+    {
+        std::lock_guard lock(mutex);
+        stopped = true;
+        not_full.notify_all();
+    }
+    worker.join();
+}
+
+bool DecompressStream::push(const char *data, size_t size) {
+    while (size != 0) {
+        std::unique_lock lock(mutex);
+        not_full.wait(lock, [&] { return stopped || filled < ring.size(); });
+        if (stopped) {
+            return false;
+        }
+        size_t tail = (head + filled) % ring.size();
+        size_t count = std::min({size, ring.size() - filled,
+                                 ring.size() - tail});
+        lock.unlock();
+
+        // only this thread writes the free part of the ring
+        std::copy_n(data, count, ring.begin() + tail);
+
+        lock.lock();
+        filled += count;
+        not_empty.notify_one();
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+size_t DecompressStream::read(char *out, size_t size) {
+    std::unique_lock lock(mutex);
+    not_empty.wait(lock, [&] { return finished || filled != 0; });
+    if (filled == 0) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return 0;
+    }
+    size_t count = std::min({size, filled, ring.size() - head});
+    lock.unlock();
+
+    // only this thread reads the filled part of the ring
+    std::copy_n(ring.begin() + head, count, out);
+
+    lock.lock();
+    head = (head + count) % ring.size();
+    filled -= count;
+    not_full.notify_one();
+    return count;
+}
@@ -0,0 +1,71 @@
+#ifndef RECOMMENDER_SYSTEM_DECOMPRESS_HPP
+#define RECOMMENDER_SYSTEM_DECOMPRESS_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * reads a .gz or .zst file, decompressing on a background thread
+ * into a bounded ring buffer, so decompression overlaps with parsing
+ * gzip needs zlib (HAVE_ZLIB) and zstd needs libzstd (HAVE_ZSTD)
+ */
+class DecompressStream {
+public:
+    /**
+     * constructor
+     * open the file and start decompressing
+     * @param filename
+     * @param capacity size of the ring buffer in bytes
+     */
+    explicit DecompressStream(const std::string &filename,
+                              size_t capacity = 16 << 20);
+
+    ~DecompressStream();
+
+    DecompressStream(const DecompressStream &) = delete;
+
+    DecompressStream &operator=(const DecompressStream &) = delete;
+
+    /**
+     * read decompressed bytes, wait until some are available
+     * an error of the decompressing thread is rethrown here
+     * @param out
+     * @param size
+     * @return count of bytes read, 0 at the end of the file
+     */
+    size_t read(char *out, size_t size);
+
+    /**
+     * whether a file is compressed, judged by its extension
+     * @param filename
+     * @return true for .gz and .zst
+     */
+    static bool is_compressed(const std::string &filename);
+
+private:
+    /**
+     * copy decompressed bytes into the ring, wait for room
+     * @param data
+     * @param size
+     * @return false if the reader is gone
+     */
+    bool push(const char *data, size_t size);
+
+    std::vector<char> ring;
+    size_t head = 0;
+    size_t filled = 0;
+    bool finished = false;
+    bool stopped = false;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::thread worker;
+};
+
+#endif //RECOMMENDER_SYSTEM_DECOMPRESS_HPP
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <atomic>
+#include "dense.hpp"
+#include "parallel.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DENSE_HAS_SIMD 1
+#include <immintrin.h>
+#endif
+
+// a micro tile is MICRO_ROWS x PANEL_ROWS elements of the result,
+// rows of a are packed PANEL_ROWS at a time
+constexpr size_t MICRO_ROWS = 4;
+constexpr size_t PANEL_ROWS = 8;
+
+// columns of a per pass, and result columns per task,
+// so the panels of a task stay in L2 during a pass
+constexpr size_t PASS_COLS = 256;
+constexpr size_t TASK_ROWS = 256;
+
+/**
+ * micro tile of the result, continued over the columns [0, cols)
+ * @param pa packed rows of the tile, stride PANEL_ROWS
+ * @param pb packed columns of the tile, stride PANEL_ROWS
+ * @param out first element of the tile, row stride ld
+ */
+static void micro_scalar(const double *pa, const double *pb, size_t cols,
+                         double *out, size_t ld) {
+    double acc[MICRO_ROWS][PANEL_ROWS];
+    for (size_t r = 0; r < MICRO_ROWS; ++r) {
+        for (size_t l = 0; l < PANEL_ROWS; ++l) {
+            acc[r][l] = out[r * ld + l];
+        }
+    }
+    for (size_t c = 0; c < cols; ++c) {
+        for (size_t r = 0; r < MICRO_ROWS; ++r) {
+            double x = pa[c * PANEL_ROWS + r];
+            for (size_t l = 0; l < PANEL_ROWS; ++l) {
+                acc[r][l] += x * pb[c * PANEL_ROWS + l];
+            }
+        }
+    }
+    for (size_t r = 0; r < MICRO_ROWS; ++r) {
+        for (size_t l = 0; l < PANEL_ROWS; ++l) {
+            out[r * ld + l] = acc[r][l];
+        }
+    }
+}
+
+#ifdef DENSE_HAS_SIMD
+
+// avx2 without fma, the multiply and the add are rounded one by one
+// like the scalar kernel
+__attribute__((target("avx2")))
+static void micro_avx2(const double *pa, const double *pb, size_t cols,
+                       double *out, size_t ld) {
+    __m256d acc[MICRO_ROWS][2];
+    for (size_t r = 0; r < MICRO_ROWS; ++r) {
+        acc[r][0] = _mm256_loadu_pd(out + r * ld);
+        acc[r][1] = _mm256_loadu_pd(out + r * ld + 4);
+    }
+    for (size_t c = 0; c < cols; ++c) {
+        __m256d b0 = _mm256_loadu_pd(pb + c * PANEL_ROWS);
+        __m256d b1 = _mm256_loadu_pd(pb + c * PANEL_ROWS + 4);
+        for (size_t r = 0; r < MICRO_ROWS; ++r) {
+            __m256d x = _mm256_broadcast_sd(pa + c * PANEL_ROWS + r);
+            acc[r][0] = _mm256_add_pd(acc[r][0], _mm256_mul_pd(x, b0));
+            acc[r][1] = _mm256_add_pd(acc[r][1], _mm256_mul_pd(x, b1));
+        }
+    }
+    for (size_t r = 0; r < MICRO_ROWS; ++r) {
+        _mm256_storeu_pd(out + r * ld, acc[r][0]);
+        _mm256_storeu_pd(out + r * ld + 4, acc[r][1]);
+    }
+}
+
+#endif
+
+DenseKernel best_dense_kernel() {
+    static const DenseKernel kernel = [] {
+#ifdef DENSE_HAS_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return DenseKernel::AVX2;
+        }
+#endif
+        return DenseKernel::SCALAR;
+    }();
+    return kernel;
+}
+
+std::vector<double> gram_matrix(const std::vector<double> &a,
+                                size_t rows, size_t cols,
+                                DenseKernel kernel) {
+    auto micro = micro_scalar;
+#ifdef DENSE_HAS_SIMD
+    if (kernel == DenseKernel::AVX2) {
+        micro = micro_avx2;
+    }
+#endif
+
+    // panel p holds a[p * PANEL_ROWS + r][c] at [c * PANEL_ROWS + r],
+    // the rows past the end are 0
+    size_t padded = (rows + PANEL_ROWS - 1) / PANEL_ROWS * PANEL_ROWS;
+    std::vector<double> panels(padded * cols, 0);
+    for (size_t i = 0; i < rows; ++i) {
+        double *panel = panels.data() + i / PANEL_ROWS * PANEL_ROWS * cols;
+        for (size_t c = 0; c < cols; ++c) {
+            panel[c * PANEL_ROWS + i % PANEL_ROWS] = a[i * cols + c];
+        }
+    }
+    auto packed = [&](size_t i, size_t c) {
+        return panels.data() + i / PANEL_ROWS * PANEL_ROWS * cols +
+               c * PANEL_ROWS + i % PANEL_ROWS;
+    };
+
+    // upper triangle by micro tiles, a task is a run of result columns
+    // and sums its elements pass after pass in column order
+    std::vector<double> full(padded * padded, 0);
+    size_t tasks = (padded + TASK_ROWS - 1) / TASK_ROWS;
+    std::atomic<size_t> next_task = 0;
+    parallel_run(std::clamp<size_t>(tasks, 1, thread_count()), [&](size_t) {
+        for (size_t task; (task = next_task++) < tasks;) {
+            size_t j_begin = task * TASK_ROWS;
+            size_t j_end = std::min(j_begin + TASK_ROWS, padded);
+            for (size_t c = 0; c < cols; c += PASS_COLS) {
+                size_t pass = std::min(PASS_COLS, cols - c);
+                for (size_t i = 0; i < j_end; i += MICRO_ROWS) {
+                    size_t j = std::max(j_begin, i / PANEL_ROWS * PANEL_ROWS);
+                    for (; j < j_end; j += PANEL_ROWS) {
+                        micro(packed(i, c), packed(j, c), pass,
+                              full.data() + i * padded + j, padded);
+                    }
+                }
+            }
+        }
+    });
+
+    // products commute, so the lower triangle is the upper one mirrored
+    std::vector<double> result(rows * rows);
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < rows; ++j) {
+            result[i * rows + j] = i <= j ? full[i * padded + j] :
+                                   full[j * padded + i];
+        }
+    }
+    return result;
+}
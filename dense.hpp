@@ -0,0 +1,37 @@
+#ifndef RECOMMENDER_SYSTEM_DENSE_HPP
+#define RECOMMENDER_SYSTEM_DENSE_HPP
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * implementations of the gram matrix,
+ * all of them give the same result
+ */
+enum class DenseKernel {
+    SCALAR,     // plain loops, the reference
+    AVX2,       // 4 x 8 micro tiles
+};
+
+/**
+ * the fastest kernel the CPU supports, checked once
+ * @return kernel
+ */
+DenseKernel best_dense_kernel();
+
+/**
+ * gram matrix of a dense matrix, a * a^T
+ * every element is summed over the columns in ascending order, with
+ * separate multiplies and adds, so every kernel gives the same result
+ * and zeros of a leave the sums unchanged
+ * @param a rows x cols values, row-major
+ * @param rows
+ * @param cols
+ * @param kernel
+ * @return rows x rows values, row-major
+ */
+std::vector<double> gram_matrix(const std::vector<double> &a,
+                                size_t rows, size_t cols,
+                                DenseKernel kernel = best_dense_kernel());
+
+#endif //RECOMMENDER_SYSTEM_DENSE_HPP
@@ -0,0 +1,77 @@
+#ifndef RECOMMENDER_SYSTEM_DUAL_MATRIX_HPP
+#define RECOMMENDER_SYSTEM_DUAL_MATRIX_HPP
+
+#include <optional>
+#include <span>
+#include "sparse_matrix.hpp"
+
+/**
+ * sparse matrix indexed both by row and by column
+ * keeps the matrix and its transpose side by side,
+ * so column access needs no rebuild
+ * @tparam T
+ */
+template<typename T>
+class DualSparseMatrix {
+public:
+    using Row = typename SparseMatrix<T>::Row;
+
+    /**
+     * constructor
+     * build the column index from a row-major matrix
+     * @param mat
+     */
+    explicit DualSparseMatrix(SparseMatrix<T> mat)
+            : by_row(std::move(mat)), by_col(by_row.transpose()) {}
+
+    /**
+     * constructor
+     * adopt a matrix and its transpose built together
+     * @param by_row
+     * @param by_col must be the transpose of by_row
+     */
+    DualSparseMatrix(SparseMatrix<T> by_row, SparseMatrix<T> by_col)
+            : by_row(std::move(by_row)), by_col(std::move(by_col)) {}
+
+    /**
+     * get item by row and col
+     * @param row
+     * @param col
+     * @return item, or nullopt if not exists
+     */
+    std::optional<T> get(size_t row, size_t col) const {
+        return by_row.get(row, col);
+    }
+
+    /**
+     * get row by row index
+     * @param row
+     * @return view of the row
+     */
+    Row get_row(size_t row) const {
+        return by_row.get_row(row);
+    }
+
+    /**
+     * get column by column index
+     * @param col
+     * @return view of the column, `cols` of the view holds row indexes
+     */
+    Row get_col(size_t col) const {
+        return by_col.get_row(col);
+    }
+
+    /**
+     * get all row indexes
+     * @return view of all non-empty row indexes, in ascending order
+     */
+    std::span<const uint32_t> row_indexes() const {
+        return by_row.row_indexes();
+    }
+
+private:
+    SparseMatrix<T> by_row;
+    SparseMatrix<T> by_col;
+};
+
+#endif //RECOMMENDER_SYSTEM_DUAL_MATRIX_HPP
@@ -0,0 +1,111 @@
+#ifndef RECOMMENDER_SYSTEM_ID_MAP_HPP
+#define RECOMMENDER_SYSTEM_ID_MAP_HPP
+
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * dictionary between external ids (as written in the dataset files)
+ * and contiguous internal ids (0, 1, 2, ... in order of first appearance)
+ */
+class IdMap {
+public:
+    IdMap() = default;
+
+    /**
+     * constructor
+     * rebuild a dictionary from its external ids
+     * @param external_ids external id of each internal id, in order
+     */
+    explicit IdMap(std::vector<size_t> external_ids)
+            : to_external(std::move(external_ids)) {
+        if (to_external.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Too many ids for 32-bit index");
+        }
+        to_internal.reserve(to_external.size());
+        for (size_t i = 0; i < to_external.size(); ++i) {
+            if (!to_internal.try_emplace(to_external[i],
+                                         static_cast<uint32_t>(i)).second) {
+                throw std::runtime_error(
+                        "Duplicate id " + std::to_string(to_external[i]));
+            }
+        }
+    }
+
+    /**
+     * get internal id of an external id, assign a new one if not seen yet
+     * @param external_id
+     * @return internal id
+     */
+    uint32_t intern(size_t external_id) {
+        auto [it, inserted] = to_internal.try_emplace(
+                external_id, static_cast<uint32_t>(to_external.size()));
+        if (inserted) {
+            if (to_external.size() >= std::numeric_limits<uint32_t>::max()) {
+                to_internal.erase(it);
+                throw std::runtime_error("Too many ids for 32-bit index");
+            }
+            to_external.emplace_back(external_id);
+        }
+        return it->second;
+    }
+
+    /**
+     * get internal id of a known external id
+     * @param external_id
+     * @return internal id
+     */
+    uint32_t at(size_t external_id) const {
+        auto it = to_internal.find(external_id);
+        if (it == to_internal.end()) {
+            throw std::runtime_error(
+                    "Unknown id " + std::to_string(external_id));
+        }
+        return it->second;
+    }
+
+    /**
+     * get external id of an internal id
+     * @param internal_id
+     * @return external id
+     */
+    size_t external(size_t internal_id) const {
+        return to_external[internal_id];
+    }
+
+    /**
+     * count of known ids
+     * @return size of the dictionary
+     */
+    size_t size() const {
+        return to_external.size();
+    }
+
+    /**
+     * get all external ids
+     * @return view of external ids, indexed by internal id
+     */
+    std::span<const size_t> external_ids() const {
+        return to_external;
+    }
+
+private:
+    std::unordered_map<size_t, uint32_t> to_internal;
+    std::vector<size_t> to_external;
+};
+
+/**
+ * id dictionaries shared by all matrices of a run
+ */
+struct IdDictionary {
+    IdMap users;
+    IdMap items;
+};
+
+#endif //RECOMMENDER_SYSTEM_ID_MAP_HPP
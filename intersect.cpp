@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <vector>
+#include "intersect.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define INTERSECT_HAS_SIMD 1
+#include <immintrin.h>
+#endif
+
+/**
+ * merge loop, also handles the tail of the SIMD kernels
+ * @param on_match called with (position in a, position in b)
+ */
+template<typename OnMatch>
+static inline void intersect_scalar(const uint32_t *a, size_t i, size_t na,
+                                    const uint32_t *b, size_t j, size_t nb,
+                                    OnMatch &&on_match) {
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (a[i] > b[j]) {
+            ++j;
+        } else {
+            on_match(i, j);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+/**
+ * report the matches of a block pair in ascending order
+ * values are distinct, so the n-th matched lane of a goes with
+ * the n-th matched lane of b
+ */
+template<typename OnMatch>
+static inline void emit_block(size_t i, uint32_t mask_a,
+                              size_t j, uint32_t mask_b,
+                              OnMatch &&on_match) {
+    while (mask_a != 0) {
+        on_match(i + __builtin_ctz(mask_a), j + __builtin_ctz(mask_b));
+        mask_a &= mask_a - 1;
+        mask_b &= mask_b - 1;
+    }
+}
+
+#ifdef INTERSECT_HAS_SIMD
+
+// a block of a is compared with every value of the current block of b,
+// then the block with the smaller last value moves on (both on a tie),
+// a kernel hands what is left to the narrower blocks and then to the
+// merge loop
+
+template<typename OnMatch>
+__attribute__((target("sse4.2")))
+static inline void blocks_sse42(const uint32_t *a, size_t &i, size_t na,
+                                const uint32_t *b, size_t &j, size_t nb,
+                                OnMatch &&on_match) {
+    constexpr size_t W = 4;
+    while (i + W <= na && j + W <= nb) {
+        __m128i block = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(a + i));
+        uint32_t mask_a = 0;
+        uint32_t mask_b = 0;
+        for (size_t t = 0; t < W; ++t) {
+            __m128i eq = _mm_cmpeq_epi32(
+                    block, _mm_set1_epi32(static_cast<int>(b[j + t])));
+            uint32_t m = _mm_movemask_ps(_mm_castsi128_ps(eq));
+            mask_a |= m;
+            mask_b |= static_cast<uint32_t>(m != 0) << t;
+        }
+        emit_block(i, mask_a, j, mask_b, on_match);
+        uint32_t last_a = a[i + W - 1];
+        uint32_t last_b = b[j + W - 1];
+        i += last_a <= last_b ? W : 0;
+        j += last_b <= last_a ? W : 0;
+    }
+}
+
+template<typename OnMatch>
+__attribute__((target("avx2")))
+static inline void blocks_avx2(const uint32_t *a, size_t &i, size_t na,
+                               const uint32_t *b, size_t &j, size_t nb,
+                               OnMatch &&on_match) {
+    constexpr size_t W = 8;
+    while (i + W <= na && j + W <= nb) {
+        __m256i block = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(a + i));
+        uint32_t mask_a = 0;
+        uint32_t mask_b = 0;
+        for (size_t t = 0; t < W; ++t) {
+            __m256i eq = _mm256_cmpeq_epi32(
+                    block, _mm256_set1_epi32(static_cast<int>(b[j + t])));
+            uint32_t m = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+            mask_a |= m;
+            mask_b |= static_cast<uint32_t>(m != 0) << t;
+        }
+        emit_block(i, mask_a, j, mask_b, on_match);
+        uint32_t last_a = a[i + W - 1];
+        uint32_t last_b = b[j + W - 1];
+        i += last_a <= last_b ? W : 0;
+        j += last_b <= last_a ? W : 0;
+    }
+}
+
+template<typename OnMatch>
+__attribute__((target("avx512f")))
+static inline void blocks_avx512(const uint32_t *a, size_t &i, size_t na,
+                                 const uint32_t *b, size_t &j, size_t nb,
+                                 OnMatch &&on_match) {
+    constexpr size_t W = 16;
+    while (i + W <= na && j + W <= nb) {
+        __m512i block = _mm512_loadu_si512(a + i);
+        uint32_t mask_a = 0;
+        uint32_t mask_b = 0;
+        for (size_t t = 0; t < W; ++t) {
+            uint32_t m = _mm512_cmpeq_epi32_mask(
+                    block, _mm512_set1_epi32(static_cast<int>(b[j + t])));
+            mask_a |= m;
+            mask_b |= static_cast<uint32_t>(m != 0) << t;
+        }
+        emit_block(i, mask_a, j, mask_b, on_match);
+        uint32_t last_a = a[i + W - 1];
+        uint32_t last_b = b[j + W - 1];
+        i += last_a <= last_b ? W : 0;
+        j += last_b <= last_a ? W : 0;
+    }
+}
+
+template<typename OnMatch>
+__attribute__((target("sse4.2")))
+static void intersect_sse42(const uint32_t *a, size_t na,
+                            const uint32_t *b, size_t nb,
+                            OnMatch &&on_match) {
+    size_t i = 0;
+    size_t j = 0;
+    blocks_sse42(a, i, na, b, j, nb, on_match);
+    intersect_scalar(a, i, na, b, j, nb, on_match);
+}
+
+template<typename OnMatch>
+__attribute__((target("avx2")))
+static void intersect_avx2(const uint32_t *a, size_t na,
+                           const uint32_t *b, size_t nb,
+                           OnMatch &&on_match) {
+    size_t i = 0;
+    size_t j = 0;
+    blocks_avx2(a, i, na, b, j, nb, on_match);
+    blocks_sse42(a, i, na, b, j, nb, on_match);
+    intersect_scalar(a, i, na, b, j, nb, on_match);
+}
+
+template<typename OnMatch>
+__attribute__((target("avx512f")))
+static void intersect_avx512(const uint32_t *a, size_t na,
+                             const uint32_t *b, size_t nb,
+                             OnMatch &&on_match) {
+    size_t i = 0;
+    size_t j = 0;
+    blocks_avx512(a, i, na, b, j, nb, on_match);
+    blocks_avx2(a, i, na, b, j, nb, on_match);
+    blocks_sse42(a, i, na, b, j, nb, on_match);
+    intersect_scalar(a, i, na, b, j, nb, on_match);
+}
+
+#endif
+
+IntersectKernel best_intersect_kernel() {
+    static const IntersectKernel kernel = [] {
+#ifdef INTERSECT_HAS_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return IntersectKernel::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return IntersectKernel::AVX2;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            return IntersectKernel::SSE42;
+        }
+#endif
+        return IntersectKernel::SCALAR;
+    }();
+    return kernel;
+}
+
+const char *intersect_kernel_name(IntersectKernel kernel) {
+    switch (kernel) {
+        case IntersectKernel::SSE42:
+            return "sse4.2";
+        case IntersectKernel::AVX2:
+            return "avx2";
+        case IntersectKernel::AVX512:
+            return "avx512";
+        default:
+            return "scalar";
+    }
+}
+
+/**
+ * run a kernel, a kernel the build does not have falls back to scalar
+ */
+template<typename OnMatch>
+static void intersect(std::span<const uint32_t> a,
+                      std::span<const uint32_t> b,
+                      IntersectKernel kernel, OnMatch &&on_match) {
+#ifdef INTERSECT_HAS_SIMD
+    switch (kernel) {
+        case IntersectKernel::SSE42:
+            intersect_sse42(a.data(), a.size(), b.data(), b.size(), on_match);
+            return;
+        case IntersectKernel::AVX2:
+            intersect_avx2(a.data(), a.size(), b.data(), b.size(), on_match);
+            return;
+        case IntersectKernel::AVX512:
+            intersect_avx512(a.data(), a.size(), b.data(), b.size(),
+                             on_match);
+            return;
+        default:
+            break;
+    }
+#endif
+    intersect_scalar(a.data(), 0, a.size(), b.data(), 0, b.size(), on_match);
+}
+
+size_t intersect_sorted(std::span<const uint32_t> a,
+                        std::span<const uint32_t> b,
+                        uint32_t *pos_a, uint32_t *pos_b,
+                        IntersectKernel kernel) {
+    size_t count = 0;
+    intersect(a, b, kernel, [&](size_t i, size_t j) {
+        pos_a[count] = static_cast<uint32_t>(i);
+        pos_b[count] = static_cast<uint32_t>(j);
+        ++count;
+    });
+    return count;
+}
+
+double centered_dot(std::span<const uint32_t> a_cols, const uint8_t *a_vals,
+                    double a_avg,
+                    std::span<const uint32_t> b_cols, const uint8_t *b_vals,
+                    double b_avg,
+                    double sum, IntersectKernel kernel) {
+    thread_local std::vector<uint32_t> pos_a;
+    thread_local std::vector<uint32_t> pos_b;
+    size_t room = std::min(a_cols.size(), b_cols.size());
+    if (pos_a.size() < room) {
+        pos_a.resize(room);
+        pos_b.resize(room);
+    }
+    size_t count = intersect_sorted(a_cols, b_cols, pos_a.data(),
+                                    pos_b.data(), kernel);
+
+    // summed outside the kernels, a target with FMA would be free to fuse
+    // the multiply and the add, and the result would depend on the kernel
+    for (size_t n = 0; n < count; ++n) {
+        sum += (a_vals[pos_a[n]] - a_avg) * (b_vals[pos_b[n]] - b_avg);
+    }
+    return sum;
+}
@@ -0,0 +1,72 @@
+#ifndef RECOMMENDER_SYSTEM_INTERSECT_HPP
+#define RECOMMENDER_SYSTEM_INTERSECT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+/**
+ * implementations of the sorted intersection,
+ * all of them find the same matches in the same order
+ */
+enum class IntersectKernel {
+    SCALAR,     // merge loop, the reference
+    SSE42,      // 4 x 4 blocks
+    AVX2,       // 8 x 8 blocks
+    AVX512,     // 16 x 16 blocks
+};
+
+/**
+ * the fastest kernel the CPU supports, checked once
+ * @return kernel
+ */
+IntersectKernel best_intersect_kernel();
+
+/**
+ * name of a kernel
+ * @param kernel
+ * @return e.g. "avx2"
+ */
+const char *intersect_kernel_name(IntersectKernel kernel);
+
+/**
+ * find the common values of two sorted arrays of distinct values
+ * @param a
+ * @param b
+ * @param pos_a receives the position in a of every match,
+ *              room for min(a.size(), b.size()) positions
+ * @param pos_b receives the position in b of every match
+ * @param kernel
+ * @return count of matches, in ascending order of value
+ */
+size_t intersect_sorted(std::span<const uint32_t> a,
+                        std::span<const uint32_t> b,
+                        uint32_t *pos_a, uint32_t *pos_b,
+                        IntersectKernel kernel = best_intersect_kernel());
+
+/**
+ * dot product of two centered sparse vectors of ratings
+ * a value is centered where it is used, as rating - average, the same
+ * double as centering it beforehand, the products are summed one by one
+ * in ascending order of column, so every kernel gives the same result as
+ * the merge loop
+ * @param a_cols sorted distinct columns of a
+ * @param a_vals ratings of a
+ * @param a_avg average subtracted from the ratings of a
+ * @param b_cols sorted distinct columns of b
+ * @param b_vals ratings of b
+ * @param b_avg average subtracted from the ratings of b
+ * @param sum the products are added to it, so a dot product can be
+ *            continued over the next range of columns
+ * @param kernel
+ * @return sum plus (a_vals[i] - a_avg) * (b_vals[j] - b_avg)
+ *         over a_cols[i] == b_cols[j]
+ */
+double centered_dot(std::span<const uint32_t> a_cols, const uint8_t *a_vals,
+                    double a_avg,
+                    std::span<const uint32_t> b_cols, const uint8_t *b_vals,
+                    double b_avg,
+                    double sum = 0,
+                    IntersectKernel kernel = best_intersect_kernel());
+
+#endif //RECOMMENDER_SYSTEM_INTERSECT_HPP
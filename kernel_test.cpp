@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "dense.hpp"
+#include "intersect.hpp"
+#include "streamvbyte.hpp"
+
+/**
+ * checks the SIMD kernels against their scalar references on random
+ * inputs, only the kernels the CPU supports are run
+ */
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+static bool same_bits(double a, double b) {
+    return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+/**
+ * sorted distinct random values
+ * @param gen
+ * @param size count of values
+ * @param range values are in [0, range)
+ * @return values
+ */
+static std::vector<uint32_t> random_sorted(std::mt19937 &gen, size_t size,
+                                           uint32_t range) {
+    std::vector<bool> taken(range, false);
+    std::uniform_int_distribution<uint32_t> pick(0, range - 1);
+    std::vector<uint32_t> values;
+    while (values.size() < size) {
+        uint32_t value = pick(gen);
+        if (!taken[value]) {
+            taken[value] = true;
+            values.emplace_back(value);
+        }
+    }
+    std::sort(values.begin(), values.end());
+    return values;
+}
+
+static void test_intersect(std::mt19937 &gen) {
+    std::uniform_int_distribution<size_t> length(0, 300);
+    std::uniform_int_distribution<int> rating(0, 100);
+    for (int round = 0; round < 2000; ++round) {
+        // dense ranges match often, sparse ones rarely
+        uint32_t range = round % 2 == 0 ? 400 : 20000;
+        auto a = random_sorted(gen, length(gen), range);
+        auto b = random_sorted(gen, length(gen), range);
+        std::vector<uint8_t> a_vals(a.size());
+        std::vector<uint8_t> b_vals(b.size());
+        for (auto &val: a_vals) {
+            val = static_cast<uint8_t>(rating(gen));
+        }
+        for (auto &val: b_vals) {
+            val = static_cast<uint8_t>(rating(gen));
+        }
+
+        size_t room = std::min(a.size(), b.size());
+        std::vector<uint32_t> ref_a(room);
+        std::vector<uint32_t> ref_b(room);
+        size_t ref_count = intersect_sorted(a, b, ref_a.data(), ref_b.data(),
+                                            IntersectKernel::SCALAR);
+        double ref_dot = centered_dot(a, a_vals.data(), 47.5,
+                                      b, b_vals.data(), 52.25, 0,
+                                      IntersectKernel::SCALAR);
+
+        for (auto kernel: {IntersectKernel::SSE42, IntersectKernel::AVX2,
+                           IntersectKernel::AVX512}) {
+            if (kernel > best_intersect_kernel()) {
+                continue;
+            }
+            std::string name = intersect_kernel_name(kernel);
+            std::vector<uint32_t> pos_a(room);
+            std::vector<uint32_t> pos_b(room);
+            size_t count = intersect_sorted(a, b, pos_a.data(), pos_b.data(),
+                                            kernel);
+            check(count == ref_count &&
+                  std::equal(pos_a.begin(), pos_a.begin() + count,
+                             ref_a.begin()) &&
+                  std::equal(pos_b.begin(), pos_b.begin() + count,
+                             ref_b.begin()),
+                  "intersect_sorted " + name);
+            double dot = centered_dot(a, a_vals.data(), 47.5,
+                                      b, b_vals.data(), 52.25, 0, kernel);
+            check(same_bits(dot, ref_dot), "centered_dot " + name);
+        }
+    }
+}
+
+static void test_gram(std::mt19937 &gen) {
+    std::uniform_real_distribution<double> value(-50, 50);
+    for (auto [rows, cols]: {std::pair<size_t, size_t>{1, 1}, {3, 5},
+                             {13, 300}, {77, 517}, {260, 40}}) {
+        std::vector<double> a(rows * cols);
+        for (auto &x: a) {
+            x = gen() % 3 == 0 ? 0 : value(gen);
+        }
+        auto ref = gram_matrix(a, rows, cols, DenseKernel::SCALAR);
+        bool ok = true;
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j < rows; ++j) {
+                double sum = 0;
+                for (size_t c = 0; c < cols; ++c) {
+                    double product = a[i * cols + c] * a[j * cols + c];
+                    sum += product;
+                }
+                ok = ok && same_bits(ref[i * rows + j], sum);
+            }
+        }
+        check(ok, "gram_matrix scalar " + std::to_string(rows) + "x" +
+                  std::to_string(cols));
+
+        if (best_dense_kernel() == DenseKernel::AVX2) {
+            auto simd = gram_matrix(a, rows, cols, DenseKernel::AVX2);
+            check(std::equal(simd.begin(), simd.end(), ref.begin(),
+                             same_bits),
+                  "gram_matrix avx2 " + std::to_string(rows) + "x" +
+                  std::to_string(cols));
+        }
+    }
+}
+
+static void test_streamvbyte(std::mt19937 &gen) {
+    std::uniform_int_distribution<size_t> length(0, 1000);
+    for (int round = 0; round < 500; ++round) {
+        // gaps of every encoded width
+        uint32_t range = round % 4 == 0 ? 1u << 31 : 1u << (8 * (round % 4));
+        auto values = random_sorted(gen, std::min<size_t>(length(gen), range),
+                                    std::min<uint32_t>(range, 1u << 20));
+        if (round % 4 == 0) {
+            for (auto &value: values) {
+                value *= 1024;
+            }
+        }
+        std::vector<uint8_t> encoded;
+        svb_encode_delta(values, 0, encoded);
+        size_t size = encoded.size();
+        encoded.resize(size + SVB_PADDING);
+        std::vector<uint32_t> decoded(values.size());
+        size_t used = svb_decode_delta(encoded.data(), values.size(), 0,
+                                       decoded.data());
+        check(used == size && decoded == values, "streamvbyte round trip");
+
+        // present values, and absent ones between and around them
+        for (size_t i = 0; i < values.size(); i += 7) {
+            uint32_t last = values.back();
+            for (uint32_t value: {values[i], values[i] + 1, last + 1}) {
+                auto it = std::lower_bound(values.begin(), values.end(),
+                                           value);
+                size_t expected = it != values.end() && *it == value ?
+                                  it - values.begin() : values.size();
+                check(svb_find_delta(encoded.data(), values.size(), 0,
+                                     value) == expected,
+                      "streamvbyte find");
+            }
+        }
+    }
+}
+
+int main() {
+    std::mt19937 gen(42);
+    test_intersect(gen);
+    test_gram(gen);
+    test_streamvbyte(gen);
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
@@ -1,7 +1,9 @@
 #include <iostream>
 #include <iomanip>
+#include <future>
 #include <cxxopts.hpp>
 #include "core.hpp"
+#include "binary_format.hpp"
 
 void doing(const std::string &str) {
     std::cout << std::setw(60) << std::left << str << " ... " << std::flush;
@@ -32,6 +34,24 @@ int main(int argc, char *argv[]) {
                  cxxopts::value<bool>()->default_value("false"))
                 ("use-weight", "use item attribute weight",
                  cxxopts::value<bool>()->default_value("false"))
+                ("pairwise", "score every pair of users, not only users "
+                             "sharing a rated item",
+                 cxxopts::value<bool>()->default_value("false"))
+                ("dense-block", "multiply the heaviest users and the most "
+                                "popular items as a dense matrix, scores may "
+                                "differ in the last bits",
+                 cxxopts::value<bool>()->default_value("false"))
+                ("compress", "compress column indexes of the train dataset",
+                 cxxopts::value<bool>()->default_value("false"))
+                ("cache", "binary cache of the train dataset, "
+                          "rebuilt when the train dataset changes",
+                 cxxopts::value<std::string>()->default_value(""))
+                ("verify-cache", "also check the checksum of the cache "
+                                 "before using it, reads every page of it",
+                 cxxopts::value<bool>()->default_value("false"))
+                ("delta", "merge new and changed ratings into the cache "
+                          "of the train dataset, then exit",
+                 cxxopts::value<std::string>()->default_value(""))
                 ("h,help", "help");
         auto cmd = options.parse(argc, argv);
 
@@ -46,6 +66,10 @@ int main(int argc, char *argv[]) {
         std::string attr_filename = cmd["attribute"].as<std::string>();
         std::string result_filename = cmd["result"].as<std::string>();
         int k = cmd["kusers"].as<int>();
+        bool compress = cmd["compress"].as<bool>();
+        std::string cache_filename = cmd["cache"].as<std::string>();
+        bool verify_cache = cmd["verify-cache"].as<bool>();
+        std::string delta_filename = cmd["delta"].as<std::string>();
         int flags = 0;
         if (cmd["use-attribute"].as<bool>()) {
             flags |= FEAT_USE_ATTR;
@@ -53,11 +77,20 @@ int main(int argc, char *argv[]) {
         if (cmd["use-weight"].as<bool>()) {
             flags |= FEAT_USE_WEIGHT;
         }
+        if (cmd["pairwise"].as<bool>()) {
+            flags |= FEAT_PAIRWISE;
+        }
+        if (cmd["dense-block"].as<bool>()) {
+            flags |= FEAT_DENSE_BLOCK;
+        }
 
         // sanity check
         if ((flags & FEAT_USE_WEIGHT) && !(flags & FEAT_USE_ATTR)) {
             throw std::runtime_error("use-weight requires use-attribute");
         }
+        if (!delta_filename.empty() && cache_filename.empty()) {
+            throw std::runtime_error("delta requires cache");
+        }
 
         // output parameters
         std::cout << "parameters:" << std::endl
@@ -71,59 +104,134 @@ int main(int argc, char *argv[]) {
                   << "use-attribute = " << std::boolalpha
                   << !!(flags & FEAT_USE_ATTR) << std::endl
                   << "use-weight    = " << std::boolalpha
-                  << !!(flags & FEAT_USE_WEIGHT) << std::endl;
+                  << !!(flags & FEAT_USE_WEIGHT) << std::endl
+                  << "pairwise      = " << std::boolalpha
+                  << !!(flags & FEAT_PAIRWISE) << std::endl
+                  << "dense-block   = " << std::boolalpha
+                  << !!(flags & FEAT_DENSE_BLOCK) << std::endl
+                  << "compress      = " << std::boolalpha
+                  << compress << std::endl
+                  << "cache         = " << cache_filename << std::endl
+                  << "verify-cache  = " << std::boolalpha
+                  << verify_cache << std::endl
+                  << "delta         = " << delta_filename << std::endl;
+
+        IdDictionary dict;
+
+        if (!delta_filename.empty()) {
+            doing("merging delta into cache");
+            auto delta = ingest_delta(train_filename, cache_filename,
+                                      delta_filename, dict);
+            done();
+
+            std::cout << "delta statistics:" << std::endl
+                      << "users   = " << delta.row_indexes().size()
+                      << std::endl
+                      << "items   = " << delta.count_nonempty_cols()
+                      << std::endl
+                      << "ratings = " << delta.get_all().size()
+                      << std::endl;
+            return 0;
+        }
+
+        // attribute and test files are parsed while the train dataset
+        // loads, their ids join the dictionary afterwards in the same
+        // order as a sequential load
+        auto parsed_attribute = std::async(std::launch::async,
+                                           parse_item_attribute_file,
+                                           attr_filename);
+        std::future<ParsedDataset> parsed_test;
+        if (!evaluate) {
+            parsed_test = std::async(std::launch::async, parse_test_dataset,
+                                     test_filename);
+        }
 
         doing("reading train dataset");
-        auto all_dataset = read_train_dataset(train_filename);
+        RatingStats all_stats;
+        auto all_dataset = cache_filename.empty() ?
+                           read_train_dataset(train_filename, dict) :
+                           read_train_dataset_cached(train_filename,
+                                                     cache_filename, dict,
+                                                     all_stats, verify_cache);
+        if (cache_filename.empty()) {
+            all_stats = get_rating_stats(all_dataset, dict);
+        }
         done();
 
         std::cout << "statistics:" << std::endl
                   << "users   = " << all_dataset.row_indexes().size()
                   << std::endl
                   << "items   = "
-                  << all_dataset.transpose().row_indexes().size()
+                  << all_dataset.count_nonempty_cols()
                   << std::endl
                   << "ratings = " << all_dataset.get_all().size()
                   << std::endl;
 
         doing("reading item attributes");
-        auto item_attribute = read_item_attribute(attr_filename);
+        auto item_attribute = intern_item_attribute(parsed_attribute.get(),
+                                                    dict);
         done();
 
         if (evaluate) {
             doing("making train and test dataset");
             auto [train_dataset, test_dataset] =
                     make_train_test(all_dataset, 3);
+            RatingStats train_stats = get_rating_stats(train_dataset, dict);
             done();
 
-            auto result = predict(train_dataset, test_dataset, item_attribute,
-                                  k, flags);
+            if (!compress) {
+                doing("building lookup index");
+                train_dataset.build_lookup_index();
+                done();
+            }
+
+            auto result = compress ?
+                          predict(CompressedSparseMatrix<Rating>(
+                                          std::move(train_dataset)),
+                                  train_stats, test_dataset, item_attribute,
+                                  dict, k, flags) :
+                          predict(train_dataset, train_stats, test_dataset,
+                                  item_attribute, dict, k, flags);
 
             std::cout << "RMSE = " << RMSE(result, test_dataset) << std::endl;
 
             doing("writing result");
-            write_dataset(result_filename, result);
+            write_dataset(result_filename, result, dict);
             done();
         } else {
             doing("reading test dataset");
-            auto test_dataset = read_test_dataset(test_filename);
+            QueryOrder order;
+            auto test_dataset = intern_dataset(parsed_test.get(), dict,
+                                               DuplicatePolicy::KEEP_ALL,
+                                               &order);
             done();
 
             std::cout << "test statistics:" << std::endl
                       << "users   = " << test_dataset.row_indexes().size()
                       << std::endl
                       << "items   = "
-                      << test_dataset.transpose().row_indexes().size()
+                      << test_dataset.count_nonempty_cols()
                       << std::endl
                       << "ratings = "
                       << test_dataset.get_all().size()
                       << std::endl;
 
-            auto result = predict(all_dataset, test_dataset, item_attribute,
-                                  k, flags);
+            if (!compress) {
+                doing("building lookup index");
+                all_dataset.build_lookup_index();
+                done();
+            }
+
+            auto result = compress ?
+                          predict(CompressedSparseMatrix<Rating>(
+                                          std::move(all_dataset)),
+                                  all_stats, test_dataset, item_attribute,
+                                  dict, k, flags) :
+                          predict(all_dataset, all_stats, test_dataset,
+                                  item_attribute, dict, k, flags);
 
             doing("writing result");
-            write_dataset_in_order(test_filename, result_filename, result);
+            write_dataset_in_order(order, result_filename, result, dict);
             done();
         }
     } catch (const std::exception &e) {
@@ -0,0 +1,37 @@
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.hpp"
+
+MappedFile::MappedFile(const std::string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file " + filename);
+    }
+
+    struct stat st{};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot stat file " + filename);
+    }
+    length = static_cast<size_t>(st.st_size);
+
+    // mmap rejects empty mappings, an empty file is just an empty view
+    if (length != 0) {
+        void *mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map file " + filename);
+        }
+        addr = static_cast<const char *>(mapped);
+    }
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (addr != nullptr) {
+        ::munmap(const_cast<char *>(addr), length);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef RECOMMENDER_SYSTEM_MAPPED_FILE_HPP
+#define RECOMMENDER_SYSTEM_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/**
+ * read-only memory mapping of a whole file
+ */
+class MappedFile {
+public:
+    /**
+     * constructor
+     * map the file, throw std::runtime_error on failure
+     * @param filename
+     */
+    explicit MappedFile(const std::string &filename);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return addr; }
+
+    size_t size() const { return length; }
+
+    std::string_view view() const { return {addr, length}; }
+
+private:
+    const char *addr = nullptr;
+    size_t length = 0;
+};
+
+#endif //RECOMMENDER_SYSTEM_MAPPED_FILE_HPP
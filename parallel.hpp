@@ -0,0 +1,57 @@
+#ifndef RECOMMENDER_SYSTEM_PARALLEL_HPP
+#define RECOMMENDER_SYSTEM_PARALLEL_HPP
+
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+/**
+ * count of worker threads to use
+ * @return hardware concurrency, at least 1
+ */
+inline size_t thread_count() {
+    size_t count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+/**
+ * run f(thread_index) on `threads` threads and wait for all of them,
+ * the first exception thrown by a worker is rethrown
+ * @param threads count of threads
+ * @param f task, called with 0 .. threads - 1
+ */
+template<typename F>
+void parallel_run(size_t threads, F &&f) {
+    if (threads <= 1) {
+        f(0);
+        return;
+    }
+
+    std::vector<std::exception_ptr> errors(threads);
+    auto task = [&](size_t index) {
+        try {
+            f(index);
+        } catch (...) {
+            errors[index] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(task, i);
+    }
+    task(0);
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    for (const auto &error: errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+#endif //RECOMMENDER_SYSTEM_PARALLEL_HPP
@@ -1,22 +1,46 @@
 #ifndef RECOMMENDER_SYSTEM_SPARSE_MATRIX_HPP
 #define RECOMMENDER_SYSTEM_SPARSE_MATRIX_HPP
 
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 #include <algorithm>
 #include <span>
-#include <set>
+#include <limits>
+#include <optional>
+#include "buffer.hpp"
+#include "parallel.hpp"
+
+/**
+ * what to do with items sharing the same (row, col)
+ */
+enum class DuplicatePolicy {
+    KEEP_LAST,  // keep the item that comes last in the input
+    SUM,        // sum the values
+    REJECT,     // throw std::runtime_error
+    KEEP_ALL,   // keep all of them, in input order
+};
 
 /**
  * sparse matrix for storing data
+ * stored as CSR in structure-of-arrays form:
+ * row offsets, 32-bit column indexes and values,
+ * the arrays are owned or view a mapped file (see binary_format.hpp)
  * @tparam T
  */
 template<typename T>
 class SparseMatrix {
 public:
+    /**
+     * a (row, col, val) triplet, used to construct the matrix
+     */
     struct Item {
-        size_t row;
-        size_t col;
+        uint32_t row;
+        uint32_t col;
         T val;
 
         bool operator<(const Item &other) const {
@@ -25,49 +49,463 @@ public:
         }
     };
 
+    /**
+     * a (col, val) pair inside a row
+     */
+    struct Entry {
+        uint32_t col;
+        T val;
+    };
+
+    /**
+     * view of a row (or of all items in row-major order)
+     */
+    struct Row {
+        std::span<const uint32_t> cols;
+        std::span<const T> vals;
+
+        class iterator {
+        public:
+            iterator(const Row *row, size_t pos) : row(row), pos(pos) {}
+
+            Entry operator*() const { return (*row)[pos]; }
+
+            iterator &operator++() {
+                ++pos;
+                return *this;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return pos != other.pos;
+            }
+
+        private:
+            const Row *row;
+            size_t pos;
+        };
+
+        size_t size() const { return cols.size(); }
+
+        Entry operator[](size_t i) const { return {cols[i], vals[i]}; }
+
+        iterator begin() const { return {this, 0}; }
+
+        iterator end() const { return {this, size()}; }
+    };
+
+    /**
+     * cursor over a row block by block,
+     * a plain row is a single block
+     */
+    class RowCursor {
+    public:
+        explicit RowCursor(Row row) : row(row) {}
+
+        /**
+         * get the next block of the row
+         * @return view of the block, empty at the end of the row
+         */
+        Row next() {
+            Row block = row;
+            row = {};
+            return block;
+        }
+
+    private:
+        Row row;
+    };
+
     /**
      * constructor
-     * construct sparse matrix from unordered items
+     * construct sparse matrix from unordered items,
+     * move the items in to avoid copying them
      * @param unordered_items
+     * @param policy how to handle duplicated (row, col)
      */
-    explicit SparseMatrix(std::vector<Item> unordered_items) {
-        for (const auto &item: unordered_items) {
-            items.emplace_back(item);
-            rows.emplace(item.row);
+    explicit SparseMatrix(
+            std::vector<Item> unordered_items,
+            DuplicatePolicy policy = DuplicatePolicy::KEEP_LAST) {
+        if (!std::is_sorted(unordered_items.begin(), unordered_items.end())) {
+            radix_sort(unordered_items);
+        }
+
+        size_t row_count = unordered_items.empty() ?
+                           0 : unordered_items.back().row + 1;
+        std::vector<size_t> offsets(row_count + 1, 0);
+        std::vector<uint32_t> item_cols;
+        std::vector<T> item_vals;
+        item_cols.reserve(unordered_items.size());
+        item_vals.reserve(unordered_items.size());
+        for (size_t i = 0; i < unordered_items.size(); ++i) {
+            const Item &item = unordered_items[i];
+            if (policy != DuplicatePolicy::KEEP_ALL && i != 0 &&
+                item.row == unordered_items[i - 1].row &&
+                item.col == unordered_items[i - 1].col) {
+                merge_duplicate(item_vals.back(), item.val, policy,
+                                item.row, item.col);
+                continue;
+            }
+            item_cols.emplace_back(item.col);
+            item_vals.emplace_back(item.val);
+            ++offsets[item.row + 1];
         }
-        std::sort(items.begin(), items.end());
+        unordered_items = {};
+
+        for (size_t i = 0; i < row_count; ++i) {
+            offsets[i + 1] += offsets[i];
+        }
+        row_offsets = std::move(offsets);
+        cols = std::move(item_cols);
+        vals = std::move(item_vals);
+        build_row_indexes();
+    }
+
+    /**
+     * construct from CSR arrays that are already sorted by (row, col),
+     * e.g. arrays viewing a mapped file
+     * @param row_offsets row i occupies [row_offsets[i], row_offsets[i + 1])
+     * @param cols column indexes
+     * @param vals values
+     * @return matrix
+     */
+    static SparseMatrix from_csr(Buffer<size_t> row_offsets,
+                                 Buffer<uint32_t> cols,
+                                 Buffer<T> vals) {
+        if (row_offsets.empty() || row_offsets.back() != cols.size() ||
+            cols.size() != vals.size()) {
+            throw std::runtime_error("Malformed CSR arrays");
+        }
+        return SparseMatrix(std::move(row_offsets), std::move(cols),
+                            std::move(vals));
+    }
+
+    /**
+     * construct from CSR arrays whose rows may be unsorted
+     * or hold duplicated columns, e.g. rows appended by a parser
+     * every row is sorted and deduplicated in place, so unlike the
+     * constructor from items there is no global sort and no second copy
+     * @param row_offsets row i occupies [row_offsets[i], row_offsets[i + 1])
+     * @param cols column indexes
+     * @param vals values
+     * @param policy how to handle duplicated (row, col), as in the
+     *               constructor, "last" is the last in the row
+     * @param positions if not null, receives for every input item the
+     *                  index in get_all() of the item it ended up in
+     * @return matrix
+     */
+    static SparseMatrix from_unsorted_rows(
+            std::vector<size_t> row_offsets,
+            std::vector<uint32_t> cols,
+            std::vector<T> vals,
+            DuplicatePolicy policy = DuplicatePolicy::KEEP_LAST,
+            std::vector<size_t> *positions = nullptr) {
+        if (row_offsets.empty() || row_offsets.front() != 0 ||
+            row_offsets.back() != cols.size() ||
+            cols.size() != vals.size() ||
+            !std::is_sorted(row_offsets.begin(), row_offsets.end())) {
+            throw std::runtime_error("Malformed CSR arrays");
+        }
+
+        size_t row_count = row_offsets.size() - 1;
+        size_t chunks = std::clamp<size_t>(cols.size() / RADIX_MIN_CHUNK,
+                                           1, thread_count());
+        std::vector<size_t> bounds(chunks + 1, row_count);
+        for (size_t t = 0; t < chunks; ++t) {
+            bounds[t] = std::lower_bound(row_offsets.begin(),
+                                         row_offsets.end() - 1,
+                                         cols.size() / chunks * t) -
+                        row_offsets.begin();
+        }
+
+        // sort and deduplicate every row, a row can only shrink,
+        // positions are row-local until the gaps are closed
+        if (positions != nullptr) {
+            positions->assign(cols.size(), 0);
+        }
+        std::vector<size_t> lengths(row_count);
+        parallel_run(chunks, [&](size_t t) {
+            std::vector<RowEntry> scratch;
+            for (size_t row = bounds[t]; row < bounds[t + 1]; ++row) {
+                size_t begin = row_offsets[row];
+                lengths[row] = sort_row(
+                        row, cols.data() + begin, vals.data() + begin,
+                        row_offsets[row + 1] - begin, policy, scratch,
+                        positions ? positions->data() + begin : nullptr);
+            }
+        });
+
+        // close the gaps left by duplicates
+        size_t out = 0;
+        for (size_t row = 0; row < row_count; ++row) {
+            size_t begin = row_offsets[row];
+            if (positions != nullptr) {
+                for (size_t i = begin; i < row_offsets[row + 1]; ++i) {
+                    (*positions)[i] += out;
+                }
+            }
+            if (begin != out) {
+                std::copy_n(cols.begin() + begin, lengths[row],
+                            cols.begin() + out);
+                std::copy_n(vals.begin() + begin, lengths[row],
+                            vals.begin() + out);
+            }
+            row_offsets[row] = out;
+            out += lengths[row];
+        }
+        row_offsets.back() = out;
+        cols.resize(out);
+        vals.resize(out);
+
+        // trailing empty rows do not exist for the constructor from items
+        while (row_offsets.size() > 1 &&
+               row_offsets[row_offsets.size() - 2] == row_offsets.back()) {
+            row_offsets.pop_back();
+        }
+        return SparseMatrix(std::move(row_offsets), std::move(cols),
+                            std::move(vals));
+    }
+
+    /**
+     * merge the rows of another matrix into this one
+     * entries of delta are added, or replace the entry in the same place,
+     * only rows of delta are merged entry by entry, the rows in between
+     * are copied as whole ranges
+     * @tparam Callback void(size_t row, uint32_t col,
+     *                       std::optional<T> old_val, T val)
+     * @param delta
+     * @param on_merge called for every entry of delta, with the entry it
+     *                 replaces if any
+     * @return merged matrix
+     */
+    template<typename Callback>
+    SparseMatrix merge(const SparseMatrix &delta, Callback &&on_merge) const {
+        size_t nnz = cols.size();
+        size_t base_rows = row_offsets.empty() ? 0 : row_offsets.size() - 1;
+        auto delta_rows = delta.row_indexes();
+        size_t row_count = delta_rows.empty() ?
+                           base_rows :
+                           std::max<size_t>(base_rows,
+                                            delta_rows.back() + 1);
+        auto base_offset = [&](size_t row) {
+            return row < base_rows ? row_offsets[row] : nnz;
+        };
+
+        // merge the rows of delta first, then the size of the result
+        // is known
+        std::vector<uint32_t> merged_cols;
+        std::vector<T> merged_vals;
+        std::vector<size_t> merged_offsets = {0};
+        size_t replaced = 0;
+        for (uint32_t row: delta_rows) {
+            Row old_row = get_row(row);
+            Row new_row = delta.get_row(row);
+            size_t i = 0;
+            size_t j = 0;
+            while (i < old_row.size() || j < new_row.size()) {
+                if (j == new_row.size() ||
+                    (i < old_row.size() && old_row.cols[i] < new_row.cols[j])) {
+                    merged_cols.emplace_back(old_row.cols[i]);
+                    merged_vals.emplace_back(old_row.vals[i]);
+                    ++i;
+                    continue;
+                }
+                std::optional<T> old_val;
+                if (i < old_row.size() && old_row.cols[i] == new_row.cols[j]) {
+                    old_val = old_row.vals[i];
+                    ++i;
+                }
+                on_merge(row, new_row.cols[j], old_val, new_row.vals[j]);
+                merged_cols.emplace_back(new_row.cols[j]);
+                merged_vals.emplace_back(new_row.vals[j]);
+                ++j;
+            }
+            replaced += old_row.size();
+            merged_offsets.emplace_back(merged_cols.size());
+        }
+
+        size_t out_nnz = nnz - replaced + merged_cols.size();
+        std::vector<size_t> out_offsets(row_count + 1);
+        std::vector<uint32_t> out_cols(out_nnz);
+        std::vector<T> out_vals(out_nnz);
+        size_t out = 0;
+        size_t row = 0;
+        auto copy_base = [&](size_t end_row) {
+            // rows [row, end_row) are not in delta
+            size_t begin = base_offset(row);
+            size_t end = base_offset(end_row);
+            for (; row < end_row; ++row) {
+                out_offsets[row] = base_offset(row) - begin + out;
+            }
+            std::copy(cols.begin() + begin, cols.begin() + end,
+                      out_cols.begin() + out);
+            std::copy(vals.begin() + begin, vals.begin() + end,
+                      out_vals.begin() + out);
+            out += end - begin;
+        };
+        for (size_t k = 0; k < delta_rows.size(); ++k) {
+            copy_base(delta_rows[k]);
+            size_t begin = merged_offsets[k];
+            size_t end = merged_offsets[k + 1];
+            out_offsets[row++] = out;
+            std::copy(merged_cols.begin() + begin, merged_cols.begin() + end,
+                      out_cols.begin() + out);
+            std::copy(merged_vals.begin() + begin, merged_vals.begin() + end,
+                      out_vals.begin() + out);
+            out += end - begin;
+        }
+        copy_base(row_count);
+        out_offsets[row_count] = out;
+
+        return SparseMatrix(std::move(out_offsets), std::move(out_cols),
+                            std::move(out_vals));
     }
 
     /**
      * transpose matrix
+     * counting sort by column, O(nnz) and split by rows across threads
      * @return transposed matrix
      */
     SparseMatrix transpose() const {
-        std::vector<Item> transposed_items;
-        for (const auto &item: items) {
-            transposed_items.emplace_back(item.col, item.row, item.val);
+        size_t nnz = cols.size();
+        size_t row_count = row_offsets.empty() ? 0 : row_offsets.size() - 1;
+        size_t col_count = nnz == 0 ?
+                           0 : *std::max_element(cols.begin(), cols.end()) + 1;
+
+        // every chunk keeps one counter per column,
+        // so only split when the chunks are much larger than that
+        size_t chunks = std::clamp<size_t>(
+                nnz / (4 * std::max<size_t>(col_count, 1)),
+                1, thread_count());
+
+        // split rows into chunks with about the same count of items
+        std::vector<size_t> bounds(chunks + 1, row_count);
+        for (size_t t = 0; t < chunks; ++t) {
+            bounds[t] = std::lower_bound(row_offsets.begin(),
+                                         row_offsets.end() - 1,
+                                         nnz / chunks * t)
+                        - row_offsets.begin();
+        }
+
+        // count items of each column in each chunk
+        std::vector<std::vector<size_t>> positions(
+                chunks, std::vector<size_t>(col_count, 0));
+        parallel_run(chunks, [&](size_t t) {
+            size_t begin = row_offsets[bounds[t]];
+            size_t end = row_offsets[bounds[t + 1]];
+            for (size_t i = begin; i < end; ++i) {
+                ++positions[t][cols[i]];
+            }
+        });
+
+        // exclusive prefix sum in (column, chunk) order
+        std::vector<size_t> offsets(col_count + 1, 0);
+        size_t running = 0;
+        for (size_t c = 0; c < col_count; ++c) {
+            offsets[c] = running;
+            for (size_t t = 0; t < chunks; ++t) {
+                size_t count = positions[t][c];
+                positions[t][c] = running;
+                running += count;
+            }
         }
-        return SparseMatrix(transposed_items);
+        offsets[col_count] = running;
+
+        // scatter, rows are visited in order so each column stays sorted
+        std::vector<uint32_t> transposed_cols(nnz);
+        std::vector<T> transposed_vals(nnz);
+        parallel_run(chunks, [&](size_t t) {
+            std::vector<size_t> &position = positions[t];
+            for (size_t row = bounds[t]; row < bounds[t + 1]; ++row) {
+                for (size_t i = row_offsets[row];
+                     i < row_offsets[row + 1]; ++i) {
+                    size_t p = position[cols[i]]++;
+                    transposed_cols[p] = static_cast<uint32_t>(row);
+                    transposed_vals[p] = vals[i];
+                }
+            }
+        });
+
+        return SparseMatrix(std::move(offsets), std::move(transposed_cols),
+                            std::move(transposed_vals));
     }
 
     /**
      * get item by row and col
      * @param row
      * @param col
-     * @return item
+     * @return item, or nullopt if not exists
      */
-    T get(size_t row, size_t col) const {
-        // binary search by lower_bound and upper_bound
-        auto lower = std::lower_bound(items.begin(), items.end(),
-                                      Item{row, col, T{}});
+    std::optional<T> get(size_t row, size_t col) const {
+        size_t pos = find(row, col);
+        if (pos == NOT_FOUND) {
+            return std::nullopt;
+        }
+        return vals[pos];
+    }
 
-        auto upper = std::upper_bound(items.begin(), items.end(),
-                                      Item{row, col, T{}});
-        if (lower == upper) {
-            return -1;
-        } else {
-            return lower->val;
+    /**
+     * look up one column in many rows
+     * @param row_ids rows to look up
+     * @param col
+     * @param found (index in row_ids, value) of every row that has the
+     *              item, in the order of row_ids
+     * @return count of rows that have the item
+     */
+    size_t gather(std::span<const uint32_t> row_ids, size_t col,
+                  std::vector<std::pair<uint32_t, T>> &found) const {
+        constexpr size_t PREFETCH_DISTANCE = 8;
+        found.clear();
+        for (size_t i = 0; i < row_ids.size(); ++i) {
+            if (i + PREFETCH_DISTANCE < row_ids.size()) {
+                prefetch_row(row_ids[i + PREFETCH_DISTANCE]);
+            }
+            size_t pos = find(row_ids[i], col);
+            if (pos != NOT_FOUND) {
+                found.emplace_back(static_cast<uint32_t>(i), vals[pos]);
+            }
         }
+        return found.size();
+    }
+
+    /**
+     * build hash tables for rows with at least heavy_row_size items,
+     * so looking them up by column is O(1) instead of a binary search
+     * a table has 4-byte slots, the smallest power of 2 count of them
+     * that is at least twice the items of the row, so it costs
+     * 8 - 16 bytes per item of those rows
+     * @param heavy_row_size
+     */
+    void build_lookup_index(size_t heavy_row_size = HEAVY_ROW_SIZE) {
+        size_t row_count = row_offsets.size() - 1;
+        lookup_offsets.assign(row_count + 1, 0);
+        for (size_t row = 0; row < row_count; ++row) {
+            size_t size = row_offsets[row + 1] - row_offsets[row];
+            size_t capacity = size >= heavy_row_size ?
+                              std::bit_ceil(2 * size) : 0;
+            lookup_offsets[row + 1] = lookup_offsets[row] + capacity;
+        }
+
+        lookup_slots.assign(lookup_offsets[row_count], 0);
+        size_t threads = thread_count();
+        parallel_run(threads, [&](size_t t) {
+            for (size_t row = t; row < row_count; row += threads) {
+                size_t capacity = lookup_offsets[row + 1] - lookup_offsets[row];
+                if (capacity == 0) {
+                    continue;
+                }
+                uint32_t *slots = &lookup_slots[lookup_offsets[row]];
+                int bits = std::countr_zero(capacity);
+                size_t begin = row_offsets[row];
+                for (size_t i = begin; i < row_offsets[row + 1]; ++i) {
+                    size_t slot = lookup_hash(cols[i], bits);
+                    while (slots[slot] != 0) {
+                        slot = (slot + 1) & (capacity - 1);
+                    }
+                    // position in the row + 1, 0 for empty slot
+                    slots[slot] = static_cast<uint32_t>(i - begin + 1);
+                }
+            }
+        });
     }
 
     /**
@@ -75,37 +513,347 @@ public:
      * @param row
      * @return view of the row
      */
-    std::span<const Item> get_row(size_t row) const {
-        // binary search by lower_bound and upper_bound
-        auto lower = std::lower_bound(
-                items.begin(), items.end(),
-                Item{row, std::numeric_limits<size_t>::min(), T{}});
-        auto upper = std::upper_bound(
-                items.begin(), items.end(),
-                Item{row, std::numeric_limits<size_t>::max(), T{}});
+    Row get_row(size_t row) const {
+        // direct index into the row offsets (CSR)
+        if (row + 1 >= row_offsets.size()) {
+            return {};
+        }
+        size_t begin = row_offsets[row];
+        size_t count = row_offsets[row + 1] - begin;
+        return {std::span<const uint32_t>(cols.data() + begin, count),
+                std::span<const T>(vals.data() + begin, count)};
+    }
 
-        return {lower, upper};
+    /**
+     * get cursor over a row
+     * @param row
+     * @return cursor
+     */
+    RowCursor row_cursor(size_t row) const {
+        return RowCursor(get_row(row));
+    }
+
+    /**
+     * count of items of a row
+     * @param row
+     * @return count of items, 0 past the last row
+     */
+    size_t row_size(size_t row) const {
+        return get_row(row).size();
     }
 
     /**
      * get all items
-     * @return view of all items
+     * @return view of all items in row-major order
      */
-    std::span<const Item> get_all() const {
-        return {items.begin(), items.end()};
+    Row get_all() const {
+        return {std::span<const uint32_t>(cols.data(), cols.size()),
+                std::span<const T>(vals.data(), vals.size())};
+    }
+
+    /**
+     * get the CSR row offsets
+     * @return view of row offsets, row i occupies
+     *         get_all()[offsets[i], offsets[i + 1])
+     */
+    std::span<const size_t> offsets() const {
+        return {row_offsets.data(), row_offsets.size()};
     }
 
     /**
      * get all row indexes
-     * @return view of all row indexes
+     * @return view of all non-empty row indexes, in ascending order
      */
-    const std::set<size_t> &row_indexes() const {
-        return rows;
+    std::span<const uint32_t> row_indexes() const {
+        return {rows.data(), rows.size()};
+    }
+
+    /**
+     * count columns that have at least one item
+     * @return count of non-empty columns
+     */
+    size_t count_nonempty_cols() const {
+        std::vector<bool> seen;
+        size_t count = 0;
+        for (uint32_t col: cols) {
+            if (col >= seen.size()) {
+                seen.resize(col + 1, false);
+            }
+            if (!seen[col]) {
+                seen[col] = true;
+                ++count;
+            }
+        }
+        return count;
     }
 
 private:
-    std::vector<Item> items;
-    std::set<size_t> rows;
+    /**
+     * constructor
+     * adopt CSR arrays which are already sorted
+     * @param row_offsets
+     * @param cols
+     * @param vals
+     */
+    SparseMatrix(Buffer<size_t> row_offsets,
+                 Buffer<uint32_t> cols,
+                 Buffer<T> vals)
+            : row_offsets(std::move(row_offsets)),
+              cols(std::move(cols)),
+              vals(std::move(vals)) {
+        build_row_indexes();
+    }
+
+    /**
+     * merge a duplicated item into the one already kept
+     * @param kept value kept so far
+     * @param val value of the duplicate
+     * @param policy
+     * @param row for error messages
+     * @param col for error messages
+     */
+    static void merge_duplicate(T &kept, T val, DuplicatePolicy policy,
+                                size_t row, size_t col) {
+        switch (policy) {
+            case DuplicatePolicy::KEEP_LAST:
+                kept = val;
+                break;
+            case DuplicatePolicy::SUM:
+                kept += val;
+                break;
+            case DuplicatePolicy::REJECT:
+                throw std::runtime_error(
+                        "Duplicate item at row " + std::to_string(row) +
+                        " col " + std::to_string(col));
+            case DuplicatePolicy::KEEP_ALL:
+                break;
+        }
+    }
+
+    /**
+     * an item of a row being sorted
+     */
+    struct RowEntry {
+        uint32_t col;
+        T val;
+        size_t index;
+    };
+
+    /**
+     * stable sort a row by column and merge duplicates in place
+     * @param row for error messages
+     * @param row_cols
+     * @param row_vals
+     * @param size count of items in the row
+     * @param policy
+     * @param scratch reused between rows
+     * @param moved_to if not null, receives the index in the row
+     *                 where each item ended up
+     * @return count of items left in the row
+     */
+    static size_t sort_row(size_t row, uint32_t *row_cols, T *row_vals,
+                           size_t size, DuplicatePolicy policy,
+                           std::vector<RowEntry> &scratch,
+                           size_t *moved_to) {
+        // rows usually arrive sorted, only then is the scan all we pay
+        bool sorted = true;
+        bool unique = true;
+        for (size_t i = 1; i < size && sorted; ++i) {
+            sorted = row_cols[i - 1] <= row_cols[i];
+            unique = unique && row_cols[i - 1] != row_cols[i];
+        }
+        if (sorted && (unique || policy == DuplicatePolicy::KEEP_ALL)) {
+            if (moved_to != nullptr) {
+                for (size_t i = 0; i < size; ++i) {
+                    moved_to[i] = i;
+                }
+            }
+            return size;
+        }
+
+        scratch.clear();
+        for (size_t i = 0; i < size; ++i) {
+            scratch.push_back({row_cols[i], row_vals[i], i});
+        }
+        if (!sorted) {
+            std::stable_sort(scratch.begin(), scratch.end(),
+                             [](const RowEntry &a, const RowEntry &b) {
+                                 return a.col < b.col;
+                             });
+        }
+
+        size_t out = 0;
+        for (const RowEntry &entry: scratch) {
+            if (policy != DuplicatePolicy::KEEP_ALL && out != 0 &&
+                entry.col == row_cols[out - 1]) {
+                merge_duplicate(row_vals[out - 1], entry.val, policy,
+                                row, entry.col);
+            } else {
+                row_cols[out] = entry.col;
+                row_vals[out] = entry.val;
+                ++out;
+            }
+            if (moved_to != nullptr) {
+                moved_to[entry.index] = out - 1;
+            }
+        }
+        return out;
+    }
+
+    static constexpr int RADIX_BITS = 11;
+    static constexpr size_t RADIX_BUCKETS = size_t{1} << RADIX_BITS;
+    static constexpr size_t RADIX_MIN_CHUNK = 1 << 16;
+
+    /**
+     * stable LSD radix sort by the packed (row, col) key,
+     * each pass is counted and scattered in parallel chunks
+     * @param items
+     */
+    static void radix_sort(std::vector<Item> &items) {
+        uint32_t max_row = 0;
+        uint32_t max_col = 0;
+        for (const auto &item: items) {
+            max_row = std::max(max_row, item.row);
+            max_col = std::max(max_col, item.col);
+        }
+        int col_bits = std::bit_width(max_col);
+        int key_bits = std::bit_width(max_row) + col_bits;
+        auto digit = [col_bits](const Item &item, int shift) {
+            uint64_t key = (static_cast<uint64_t>(item.row) << col_bits) |
+                           item.col;
+            return (key >> shift) & (RADIX_BUCKETS - 1);
+        };
+
+        size_t n = items.size();
+        size_t chunks = std::clamp<size_t>(n / RADIX_MIN_CHUNK,
+                                           1, thread_count());
+        std::vector<Item> buffer(n);
+        std::vector<size_t> positions(chunks * RADIX_BUCKETS);
+
+        for (int shift = 0; shift < key_bits; shift += RADIX_BITS) {
+            std::fill(positions.begin(), positions.end(), 0);
+            parallel_run(chunks, [&](size_t t) {
+                size_t *position = &positions[t * RADIX_BUCKETS];
+                for (size_t i = n * t / chunks; i < n * (t + 1) / chunks; ++i) {
+                    ++position[digit(items[i], shift)];
+                }
+            });
+
+            // exclusive prefix sum in (digit, chunk) order keeps it stable
+            size_t running = 0;
+            for (size_t d = 0; d < RADIX_BUCKETS; ++d) {
+                for (size_t t = 0; t < chunks; ++t) {
+                    size_t count = positions[t * RADIX_BUCKETS + d];
+                    positions[t * RADIX_BUCKETS + d] = running;
+                    running += count;
+                }
+            }
+
+            parallel_run(chunks, [&](size_t t) {
+                size_t *position = &positions[t * RADIX_BUCKETS];
+                for (size_t i = n * t / chunks; i < n * (t + 1) / chunks; ++i) {
+                    buffer[position[digit(items[i], shift)]++] = items[i];
+                }
+            });
+            items.swap(buffer);
+        }
+    }
+
+    static constexpr size_t NOT_FOUND = std::numeric_limits<size_t>::max();
+    static constexpr size_t HEAVY_ROW_SIZE = 64;
+
+    /**
+     * multiplicative hash of a column, for a table of 2^bits slots
+     * @param col
+     * @param bits
+     * @return slot
+     */
+    static size_t lookup_hash(uint32_t col, int bits) {
+        return static_cast<uint32_t>(col * 2654435761u) >> (32 - bits);
+    }
+
+    /**
+     * find position of an item in cols/vals
+     * @param row
+     * @param col
+     * @return position, or NOT_FOUND
+     */
+    size_t find(size_t row, size_t col) const {
+        if (row + 1 >= row_offsets.size()) {
+            return NOT_FOUND;
+        }
+        size_t begin = row_offsets[row];
+        size_t end = row_offsets[row + 1];
+
+        // heavy row: probe its hash table
+        if (row + 1 < lookup_offsets.size() &&
+            lookup_offsets[row] != lookup_offsets[row + 1]) {
+            size_t capacity = lookup_offsets[row + 1] - lookup_offsets[row];
+            const uint32_t *slots = &lookup_slots[lookup_offsets[row]];
+            size_t slot = lookup_hash(static_cast<uint32_t>(col),
+                                      std::countr_zero(capacity));
+            while (slots[slot] != 0) {
+                size_t pos = begin + slots[slot] - 1;
+                if (cols[pos] == col) {
+                    return pos;
+                }
+                slot = (slot + 1) & (capacity - 1);
+            }
+            return NOT_FOUND;
+        }
+
+        // light row: binary search inside the row
+        auto first = cols.begin() + begin;
+        auto last = cols.begin() + end;
+        auto it = std::lower_bound(first, last, col);
+        if (it == last || *it != col) {
+            return NOT_FOUND;
+        }
+        return it - cols.begin();
+    }
+
+    /**
+     * prefetch the start of a row (and its hash table)
+     * @param row
+     */
+    void prefetch_row(size_t row) const {
+        if (row + 1 >= row_offsets.size()) {
+            return;
+        }
+        __builtin_prefetch(cols.data() + row_offsets[row]);
+        if (row + 1 < lookup_offsets.size() &&
+            lookup_offsets[row] != lookup_offsets[row + 1]) {
+            __builtin_prefetch(lookup_slots.data() + lookup_offsets[row]);
+        }
+    }
+
+    /**
+     * collect non-empty rows from the row offsets
+     */
+    void build_row_indexes() {
+        size_t count = 0;
+        for (size_t row = 0; row + 1 < row_offsets.size(); ++row) {
+            count += row_offsets[row] != row_offsets[row + 1];
+        }
+        std::vector<uint32_t> non_empty;
+        non_empty.reserve(count);
+        for (size_t row = 0; row + 1 < row_offsets.size(); ++row) {
+            if (row_offsets[row] != row_offsets[row + 1]) {
+                non_empty.emplace_back(static_cast<uint32_t>(row));
+            }
+        }
+        rows = std::move(non_empty);
+    }
+
+    // row i occupies cols/vals[row_offsets[i], row_offsets[i + 1])
+    Buffer<size_t> row_offsets;
+    Buffer<uint32_t> cols;
+    Buffer<T> vals;
+    Buffer<uint32_t> rows;
+
+    // hash tables of heavy rows, see build_lookup_index()
+    std::vector<size_t> lookup_offsets;
+    std::vector<uint32_t> lookup_slots;
 };
 
 #endif //RECOMMENDER_SYSTEM_SPARSE_MATRIX_HPP
@@ -0,0 +1,212 @@
+#include <array>
+#include "streamvbyte.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SVB_HAS_SSSE3 1
+#include <immintrin.h>
+#endif
+
+/**
+ * encoded length of a value
+ * @param val
+ * @return 1 - 4 bytes
+ */
+static inline uint32_t encoded_length(uint32_t val) {
+    if (val < (1u << 8)) {
+        return 1;
+    } else if (val < (1u << 16)) {
+        return 2;
+    } else if (val < (1u << 24)) {
+        return 3;
+    }
+    return 4;
+}
+
+void svb_encode_delta(std::span<const uint32_t> values, uint32_t prev,
+                      std::vector<uint8_t> &out) {
+    size_t control_pos = out.size();
+    size_t data_pos = control_pos + (values.size() + 3) / 4;
+    // reserve the worst case, shrink at the end
+    out.resize(data_pos + values.size() * 4, 0);
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        uint32_t delta = values[i] - prev;
+        prev = values[i];
+
+        uint32_t length = encoded_length(delta);
+        out[control_pos + i / 4] |= (length - 1) << (2 * (i % 4));
+        for (uint32_t b = 0; b < length; ++b) {
+            out[data_pos++] = static_cast<uint8_t>(delta >> (8 * b));
+        }
+    }
+    out.resize(data_pos);
+}
+
+/**
+ * scalar decoder, also handles the tail of the SIMD decoder
+ */
+static size_t decode_scalar(const uint8_t *control, const uint8_t *data,
+                            size_t begin, size_t count, uint32_t prev,
+                            uint32_t *out) {
+    const uint8_t *data_begin = data;
+    for (size_t i = begin; i < count; ++i) {
+        uint32_t length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        uint32_t delta = 0;
+        for (uint32_t b = 0; b < length; ++b) {
+            delta |= static_cast<uint32_t>(data[b]) << (8 * b);
+        }
+        data += length;
+        prev += delta;
+        out[i] = prev;
+    }
+    return data - data_begin;
+}
+
+/**
+ * scalar search, also handles the tail of the SIMD search
+ */
+static size_t find_scalar(const uint8_t *control, const uint8_t *data,
+                          size_t begin, size_t count, uint32_t prev,
+                          uint32_t value) {
+    for (size_t i = begin; i < count; ++i) {
+        uint32_t length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        uint32_t delta = 0;
+        for (uint32_t b = 0; b < length; ++b) {
+            delta |= static_cast<uint32_t>(data[b]) << (8 * b);
+        }
+        data += length;
+        prev += delta;
+        if (prev >= value) {
+            return prev == value ? i : count;
+        }
+    }
+    return count;
+}
+
+#ifdef SVB_HAS_SSSE3
+
+/**
+ * shuffle masks and data lengths for each control byte
+ */
+struct SvbTables {
+    std::array<std::array<uint8_t, 16>, 256> shuffle{};
+    std::array<uint8_t, 256> length{};
+
+    constexpr SvbTables() {
+        for (size_t control = 0; control < 256; ++control) {
+            uint8_t src = 0;
+            for (size_t lane = 0; lane < 4; ++lane) {
+                size_t bytes = ((control >> (2 * lane)) & 3) + 1;
+                for (size_t b = 0; b < 4; ++b) {
+                    shuffle[control][lane * 4 + b] =
+                            b < bytes ? src++ : 0xFF;
+                }
+            }
+            length[control] = src;
+        }
+    }
+};
+
+static constexpr SvbTables svb_tables{};
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const uint8_t *control, const uint8_t *data,
+                           size_t count, uint32_t prev, uint32_t *out) {
+    const uint8_t *data_begin = data;
+    __m128i carry = _mm_set1_epi32(static_cast<int>(prev));
+    size_t quads = count / 4;
+    for (size_t q = 0; q < quads; ++q) {
+        uint8_t c = control[q];
+        __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                                               svb_tables.shuffle[c].data()));
+        __m128i bytes = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data));
+        __m128i deltas = _mm_shuffle_epi8(bytes, mask);
+        data += svb_tables.length[c];
+
+        // prefix sum of the 4 deltas
+        deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 4));
+        deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 8));
+        __m128i values = _mm_add_epi32(deltas, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + q * 4), values);
+        carry = _mm_shuffle_epi32(values, 0xFF);
+    }
+    if (quads * 4 < count) {
+        prev = static_cast<uint32_t>(_mm_cvtsi128_si32(carry));
+        data += decode_scalar(control, data, quads * 4, count, prev, out);
+    }
+    return data - data_begin;
+}
+
+__attribute__((target("ssse3")))
+static size_t find_ssse3(const uint8_t *control, const uint8_t *data,
+                         size_t count, uint32_t prev, uint32_t value) {
+    __m128i carry = _mm_set1_epi32(static_cast<int>(prev));
+    size_t quads = count / 4;
+    for (size_t q = 0; q < quads; ++q) {
+        uint8_t c = control[q];
+        __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                                               svb_tables.shuffle[c].data()));
+        __m128i bytes = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data));
+        __m128i deltas = _mm_shuffle_epi8(bytes, mask);
+        data += svb_tables.length[c];
+
+        deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 4));
+        deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 8));
+        __m128i values = _mm_add_epi32(deltas, carry);
+        carry = _mm_shuffle_epi32(values, 0xFF);
+
+        // the values are sorted, so the quad holds the value only if
+        // its last one is not less
+        if (static_cast<uint32_t>(_mm_cvtsi128_si32(carry)) >= value) {
+            std::array<uint32_t, 4> lanes;
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes.data()),
+                             values);
+            for (size_t lane = 0; lane < 4; ++lane) {
+                if (lanes[lane] >= value) {
+                    return lanes[lane] == value ? q * 4 + lane : count;
+                }
+            }
+        }
+    }
+    prev = static_cast<uint32_t>(_mm_cvtsi128_si32(carry));
+    return find_scalar(control, data, quads * 4, count, prev, value);
+}
+
+/**
+ * check once whether the CPU supports SSSE3
+ * @return whether to use the SSSE3 decoder
+ */
+static bool svb_use_ssse3() {
+    static const bool supported = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3") != 0;
+    }();
+    return supported;
+}
+
+#endif
+
+size_t svb_decode_delta(const uint8_t *in, size_t count, uint32_t prev,
+                        uint32_t *out) {
+    size_t control_size = (count + 3) / 4;
+    const uint8_t *data = in + control_size;
+#ifdef SVB_HAS_SSSE3
+    if (svb_use_ssse3()) {
+        return control_size + decode_ssse3(in, data, count, prev, out);
+    }
+#endif
+    return control_size + decode_scalar(in, data, 0, count, prev, out);
+}
+
+size_t svb_find_delta(const uint8_t *in, size_t count, uint32_t prev,
+                      uint32_t value) {
+    const uint8_t *data = in + (count + 3) / 4;
+#ifdef SVB_HAS_SSSE3
+    if (svb_use_ssse3()) {
+        return find_ssse3(in, data, count, prev, value);
+    }
+#endif
+    return find_scalar(in, data, 0, count, prev, value);
+}
@@ -0,0 +1,46 @@
+#ifndef RECOMMENDER_SYSTEM_STREAMVBYTE_HPP
+#define RECOMMENDER_SYSTEM_STREAMVBYTE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// bytes that must be readable after the end of encoded data,
+// the SIMD decoder always loads 16 bytes at once
+constexpr size_t SVB_PADDING = 16;
+
+/**
+ * encode sorted integers with delta + StreamVByte
+ * (2-bit length per value in the control bytes, then 1 - 4 data bytes)
+ * @param values sorted values to encode
+ * @param prev value the first delta is taken from
+ * @param out encoded bytes are appended to it
+ */
+void svb_encode_delta(std::span<const uint32_t> values, uint32_t prev,
+                      std::vector<uint8_t> &out);
+
+/**
+ * decode integers encoded by svb_encode_delta
+ * @param in encoded bytes, followed by at least SVB_PADDING readable bytes
+ * @param count count of values
+ * @param prev same value as passed to svb_encode_delta
+ * @param out decoded values
+ * @return count of bytes consumed
+ */
+size_t svb_decode_delta(const uint8_t *in, size_t count, uint32_t prev,
+                        uint32_t *out);
+
+/**
+ * find a value in integers encoded by svb_encode_delta,
+ * decoding stops at the first value not less than it
+ * @param in encoded bytes, followed by at least SVB_PADDING readable bytes
+ * @param count count of values
+ * @param prev same value as passed to svb_encode_delta
+ * @param value value to find
+ * @return index of the value, or count if it is not there
+ */
+size_t svb_find_delta(const uint8_t *in, size_t count, uint32_t prev,
+                      uint32_t value);
+
+#endif //RECOMMENDER_SYSTEM_STREAMVBYTE_HPP
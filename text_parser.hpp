@@ -0,0 +1,285 @@
+#ifndef RECOMMENDER_SYSTEM_TEXT_PARSER_HPP
+#define RECOMMENDER_SYSTEM_TEXT_PARSER_HPP
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+/**
+ * cursor over the text of a dataset file
+ * numbers are parsed in place with std::from_chars, nothing is allocated
+ * unless an error is reported
+ */
+class TextScanner {
+public:
+    /**
+     * constructor
+     * @param text whole text, line numbers are counted from its beginning
+     * @param name file name used in error messages
+     * @param begin position to start scanning from
+     * @param end position to stop scanning at
+     * @param first_line line number of the beginning of the text
+     */
+    TextScanner(std::string_view text, std::string_view name,
+                size_t begin = 0, size_t end = std::string_view::npos,
+                size_t first_line = 1)
+            : text(text), name(name), pos(begin),
+              end(std::min(end, text.size())), first_line(first_line) {}
+
+    /**
+     * skip whitespace, newlines included
+     * @return whether anything is left
+     */
+    bool skip_space() {
+        while (pos < end && is_space(text[pos])) {
+            ++pos;
+        }
+        return pos < end;
+    }
+
+    /**
+     * read a number after optional whitespace,
+     * it must end at whitespace, '|' or the end of the text
+     * @tparam T integer or floating point type
+     * @param what name of the field, for error messages
+     * @return number
+     */
+    template<typename T>
+    T read_number(std::string_view what) {
+        skip_space();
+        T value{};
+        auto [ptr, ec] = std::from_chars(text.data() + pos,
+                                         text.data() + end, value);
+        if (ec != std::errc() || (ptr != text.data() + end &&
+                                  !is_space(*ptr) && *ptr != '|')) {
+            throw error("expected " + std::string(what));
+        }
+        pos = ptr - text.data();
+        return value;
+    }
+
+    /**
+     * read a score after optional whitespace
+     * integral scores (the common case) skip floating point parsing
+     * @param what name of the field, for error messages
+     * @return score
+     */
+    double read_score(std::string_view what) {
+        skip_space();
+        uint32_t value = 0;
+        auto [ptr, ec] = std::from_chars(text.data() + pos,
+                                         text.data() + end, value);
+        if (ec == std::errc() &&
+            (ptr == text.data() + end || is_space(*ptr))) {
+            pos = ptr - text.data();
+            return value;
+        }
+        return read_number<double>(what);
+    }
+
+    /**
+     * read a single character after optional whitespace
+     * @param c expected character
+     */
+    void expect(char c) {
+        skip_space();
+        if (pos == end || text[pos] != c) {
+            throw error(std::string("expected '") + c + "'");
+        }
+        ++pos;
+    }
+
+    /**
+     * read a word after optional whitespace if it is there,
+     * it must end at whitespace, '|' or the end of the text
+     * @param word
+     * @return whether the word was read
+     */
+    bool accept(std::string_view word) {
+        skip_space();
+        size_t after = pos + word.size();
+        if (text.substr(pos, end - pos).starts_with(word) &&
+            (after == end || is_space(text[after]) || text[after] == '|')) {
+            pos = after;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * current position in the text
+     * @return offset from the beginning of the text
+     */
+    size_t position() const {
+        return pos;
+    }
+
+    /**
+     * make an error pointing at the current line
+     * lines are only counted here, so scanning does not pay for it
+     * @param message
+     * @return error to throw
+     */
+    std::runtime_error error(const std::string &message) const {
+        size_t at = pos;
+        // running out of text is reported on the last line that has text
+        if (at == end) {
+            while (at > 0 && is_space(text[at - 1])) {
+                --at;
+            }
+        }
+        size_t line = first_line +
+                      std::count(text.begin(), text.begin() + at, '\n');
+        return std::runtime_error(std::string(name) + ":" +
+                                  std::to_string(line) + ": " + message);
+    }
+
+private:
+    static bool is_space(char c) {
+        return c == ' ' || ('\t' <= c && c <= '\r');
+    }
+
+    std::string_view text;
+    std::string_view name;
+    size_t pos;
+    size_t end;
+    size_t first_line;
+};
+
+/**
+ * parse a train or test dataset
+ * records are "user|count" followed by count entries of "item score"
+ * (or just "item" without score), separated by any whitespace
+ * @param scanner
+ * @param has_score whether the dataset has score
+ * @param on_item called with (user, item, score) of every entry in order,
+ *                a std::runtime_error thrown by it is reported with
+ *                the line number
+ */
+template<typename F>
+void parse_dataset(TextScanner &scanner, bool has_score, F &&on_item) {
+    while (scanner.skip_space()) {
+        auto user_id = scanner.read_number<size_t>("user id");
+        scanner.expect('|');
+        auto items_count = scanner.read_number<size_t>("item count");
+        for (size_t i = 0; i < items_count; ++i) {
+            auto item_id = scanner.read_number<size_t>("item id");
+            double score = has_score ?
+                           scanner.read_score("score") : 0;
+            try {
+                on_item(user_id, item_id, score);
+            } catch (const std::runtime_error &e) {
+                throw scanner.error(e.what());
+            }
+        }
+    }
+}
+
+/**
+ * parse an item attribute file
+ * records are "item|attr1|attr2", a missing attribute is "None"
+ * @param scanner
+ * @param on_item called with (item, attr1, attr2) of every record,
+ *                std::nullopt for "None", a std::runtime_error thrown by
+ *                it is reported with the line number
+ */
+template<typename F>
+void parse_item_attribute(TextScanner &scanner, F &&on_item) {
+    auto read_attribute = [&]() -> std::optional<uint32_t> {
+        if (scanner.accept("None")) {
+            return std::nullopt;
+        }
+        return scanner.read_number<uint32_t>("attribute");
+    };
+
+    while (scanner.skip_space()) {
+        auto item_id = scanner.read_number<size_t>("item id");
+        scanner.expect('|');
+        auto attr1 = read_attribute();
+        scanner.expect('|');
+        auto attr2 = read_attribute();
+        try {
+            on_item(item_id, attr1, attr2);
+        } catch (const std::runtime_error &e) {
+            throw scanner.error(e.what());
+        }
+    }
+}
+
+/**
+ * split a dataset into chunks that start at record headers,
+ * so every chunk can be parsed on its own
+ * item lines never contain '|', so the line holding the next '|'
+ * after a split point is a "user|count" header
+ * @param text
+ * @param chunks count of chunks wanted
+ * @return chunk boundaries, chunk i is [bounds[i], bounds[i + 1]),
+ *         chunks may be empty
+ */
+inline std::vector<size_t> split_dataset(std::string_view text,
+                                         size_t chunks) {
+    std::vector<size_t> bounds(chunks + 1, text.size());
+    bounds[0] = 0;
+    for (size_t i = 1; i < chunks; ++i) {
+        size_t guess = std::max(text.size() / chunks * i, bounds[i - 1]);
+        size_t bar = text.find('|', guess);
+        if (bar == std::string_view::npos) {
+            break;
+        }
+        size_t newline = text.rfind('\n', bar);
+        bounds[i] = newline == std::string_view::npos ? 0 : newline + 1;
+    }
+    return bounds;
+}
+
+/**
+ * find where the last record of a part of a dataset begins,
+ * everything before it is made of complete records
+ * @param text
+ * @return beginning of the line of the last "user|count" header,
+ *         0 if there is at most one record
+ */
+inline size_t last_record_start(std::string_view text) {
+    size_t bar = text.rfind('|');
+    if (bar == std::string_view::npos) {
+        return 0;
+    }
+    size_t newline = text.rfind('\n', bar);
+    return newline == std::string_view::npos ? 0 : newline + 1;
+}
+
+/**
+ * count the entries of a part of a dataset without parsing them,
+ * only the "user|count" headers are read
+ * @param text whole text
+ * @param name file name used in error messages
+ * @param begin beginning of the part, at a header
+ * @param end end of the part
+ * @return sum of the item counts of the headers
+ */
+inline size_t count_dataset_entries(std::string_view text,
+                                    std::string_view name,
+                                    size_t begin, size_t end) {
+    size_t count = 0;
+    for (size_t bar = text.find('|', begin); bar < end;
+         bar = text.find('|', bar + 1)) {
+        TextScanner scanner(text, name, bar + 1, end);
+        auto items_count = scanner.read_number<size_t>("item count");
+        // every entry takes at least 2 bytes, this also keeps the sum
+        // from overflowing
+        if (items_count > (end - bar) / 2) {
+            throw scanner.error("item count exceeds the file size");
+        }
+        count += items_count;
+    }
+    return count;
+}
+
+#endif //RECOMMENDER_SYSTEM_TEXT_PARSER_HPP
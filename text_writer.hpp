@@ -0,0 +1,82 @@
+#ifndef RECOMMENDER_SYSTEM_TEXT_WRITER_HPP
+#define RECOMMENDER_SYSTEM_TEXT_WRITER_HPP
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "parallel.hpp"
+
+/**
+ * append an integer to a buffer
+ * @param out
+ * @param value
+ */
+inline void append_number(std::string &out, size_t value) {
+    std::array<char, 24> buffer;
+    auto [ptr, ec] = std::to_chars(buffer.data(),
+                                   buffer.data() + buffer.size(), value);
+    out.append(buffer.data(), ptr);
+}
+
+/**
+ * append a floating point number to a buffer,
+ * formatted like the default of std::ostream (%g, 6 significant digits)
+ * @param out
+ * @param value
+ */
+inline void append_number(std::string &out, double value) {
+    std::array<char, 32> buffer;
+    auto [ptr, ec] = std::to_chars(buffer.data(),
+                                   buffer.data() + buffer.size(), value,
+                                   std::chars_format::general, 6);
+    out.append(buffer.data(), ptr);
+}
+
+// blocks formatted by a thread before the buffers are written out
+constexpr size_t WRITE_BATCH = 1 << 12;
+
+/**
+ * write blocks of text to a file in order
+ * blocks are formatted into per-thread buffers in parallel, a batch at a
+ * time, and every buffer goes to the file in one write
+ * @param filename
+ * @param count count of blocks
+ * @param format format(i, out) appends block i to out
+ */
+template<typename F>
+void write_blocks(const std::string &filename, size_t count, F &&format) {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open file " + filename);
+    }
+
+    size_t threads = std::clamp<size_t>(count / WRITE_BATCH, 1,
+                                        thread_count());
+    std::vector<std::string> buffers(threads);
+    for (size_t begin = 0; begin < count; begin += threads * WRITE_BATCH) {
+        parallel_run(threads, [&](size_t t) {
+            size_t first = std::min(count, begin + t * WRITE_BATCH);
+            size_t last = std::min(count, first + WRITE_BATCH);
+            buffers[t].clear();
+            for (size_t i = first; i < last; ++i) {
+                format(i, buffers[t]);
+            }
+        });
+        for (const auto &buffer: buffers) {
+            file.write(buffer.data(),
+                       static_cast<std::streamsize>(buffer.size()));
+        }
+    }
+
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Cannot write file " + filename);
+    }
+}
+
+#endif //RECOMMENDER_SYSTEM_TEXT_WRITER_HPP